@@ -136,20 +136,32 @@ fn main() {
     println!("cargo:rustc-link-lib=lapack");
 
     let library = Library::probe().unwrap();
+    // the wrapper is linked before the extractor it calls
     cc::Build::new()
-        .file("src/ORB_SLAM3/ORBextractor.cc")
         .file("src/ORB_SLAM3/ORBwrapper.cc")
         .includes(&library.include_paths)
         .flag("-Wno-unused")
+        .compile("ORBwrapper");
+
+    cc::Build::new()
+        .file("src/ORB_SLAM3/ORBextractor.cc")
+        .file("src/ORB_SLAM3/ORBsimd.cc")
+        .includes(&library.include_paths)
+        .flag("-Wno-unused")
+        // keep the SIMD kernels bit-identical to the scalar ones, only these two files need it
+        .flag_if_supported("-ffp-contract=off")
         .compile("ORBextractor3");
 
     cc::Build::new()
         .include("src/faiss")
         .file("src/faiss/error_impl.cpp")
+        .file("src/faiss/AuxIndexStructures_c.cpp")
         .file("src/faiss/index_factory_c.cpp")
+        .file("src/faiss/Index_c.cpp")
         .file("src/faiss/index_io_c.cpp")
         .file("src/faiss/IndexBinary_c.cpp")
         .file("src/faiss/IndexBinaryIVF_c.cpp")
+        .file("src/faiss/IndexBinaryHNSW_c.cpp")
         // .include("/home/yhb/.miniconda3/include")
         .flag("-Wno-strict-aliasing")
         .compile("faiss_wrapper");
@@ -56,9 +56,12 @@
 #include <opencv2/features2d/features2d.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <vector>
+#include <atomic>
+#include <memory>
 #include <iostream>
 
 #include "ORBextractor.h"
+#include "ORBsimd.h"
 
 
 using namespace cv;
@@ -408,7 +411,9 @@ namespace ORB_SLAM3
     ORBextractor::ORBextractor(int _nfeatures, float _scaleFactor, int _nlevels,
                                int _iniThFAST, int _minThFAST, int _interpolation, bool _angle):
             nfeatures(_nfeatures), scaleFactor(_scaleFactor), nlevels(_nlevels),
-            iniThFAST(_iniThFAST), minThFAST(_minThFAST), interpolation(_interpolation), angle(_angle)
+            iniThFAST(_iniThFAST), minThFAST(_minThFAST), interpolation(_interpolation), angle(_angle),
+            mbReuseBuffers(false), mbParallel(false), mbBlurTiles(false), mbTimeStages(false),
+            mbSimd(simd::Enabled())
     {
         mvScaleFactor.resize(nlevels);
         mvLevelSigma2.resize(nlevels);
@@ -429,6 +434,10 @@ namespace ORB_SLAM3
         }
 
         mvImagePyramid.resize(nlevels);
+        mvPyramidBuffer.resize(nlevels);
+        mvToDistributeKeys.resize(nlevels);
+        mvStageTicks.assign(NSTAGES, 0);
+        mvOrientationTicks.assign(nlevels, 0);
 
         mnFeaturesPerLevel.resize(nlevels);
         float factor = 1.0f / scaleFactor;
@@ -465,10 +474,30 @@ namespace ORB_SLAM3
             umax[v] = v0;
             ++v0;
         }
+
+        if (simd::Enabled())
+        {
+            mpAngleWeights = std::make_shared<const simd::AngleWeights>(umax);
+            mpPatternTable = std::make_shared<const simd::PatternTable>(pattern);
+        }
     }
 
-    static void computeOrientation(const Mat& image, vector<KeyPoint>& keypoints, const vector<int>& umax)
+    // weights is only given when the SIMD kernels are enabled
+    static void computeOrientation(const Mat& image, vector<KeyPoint>& keypoints, const vector<int>& umax,
+                                   const simd::AngleWeights* weights)
     {
+        if (weights)
+        {
+            const int step = (int)image.step1();
+            for (vector<KeyPoint>::iterator keypoint = keypoints.begin(),
+                         keypointEnd = keypoints.end(); keypoint != keypointEnd; ++keypoint)
+            {
+                const uchar* center = &image.at<uchar>(cvRound(keypoint->pt.y), cvRound(keypoint->pt.x));
+                keypoint->angle = simd::IC_Angle(center, step, *weights);
+            }
+            return;
+        }
+
         for (vector<KeyPoint>::iterator keypoint = keypoints.begin(),
                      keypointEnd = keypoints.end(); keypoint != keypointEnd; ++keypoint)
         {
@@ -766,116 +795,136 @@ namespace ORB_SLAM3
 
         const float W = 35;
 
+        struct LevelGrid
+        {
+            int minBorderX, minBorderY, maxBorderX, maxBorderY;
+            int nCols, nRows, wCell, hCell;
+            int firstCell;
+        };
+
+        // Every level is split into cells of about W x W pixels, FAST runs on each cell independently
+        vector<LevelGrid> vGrids(nlevels);
+        int nCells = 0;
         for (int level = 0; level < nlevels; ++level)
         {
-            const int minBorderX = EDGE_THRESHOLD-3;
-            const int minBorderY = minBorderX;
-            const int maxBorderX = mvImagePyramid[level].cols-EDGE_THRESHOLD+3;
-            const int maxBorderY = mvImagePyramid[level].rows-EDGE_THRESHOLD+3;
+            LevelGrid &grid = vGrids[level];
+            grid.minBorderX = EDGE_THRESHOLD-3;
+            grid.minBorderY = grid.minBorderX;
+            grid.maxBorderX = mvImagePyramid[level].cols-EDGE_THRESHOLD+3;
+            grid.maxBorderY = mvImagePyramid[level].rows-EDGE_THRESHOLD+3;
+
+            const float width = (grid.maxBorderX-grid.minBorderX);
+            const float height = (grid.maxBorderY-grid.minBorderY);
+
+            grid.nCols = width/W;
+            grid.nRows = height/W;
+            grid.wCell = ceil(width/grid.nCols);
+            grid.hCell = ceil(height/grid.nRows);
+            grid.firstCell = nCells;
+            nCells += grid.nRows*grid.nCols;
+        }
 
-            vector<cv::KeyPoint> vToDistributeKeys;
-            vToDistributeKeys.reserve(nfeatures*10);
+        vector<vector<cv::KeyPoint> > vCellKeys(nCells);
 
-            const float width = (maxBorderX-minBorderX);
-            const float height = (maxBorderY-minBorderY);
+        auto detectCells = [&](const Range& range)
+        {
+            int level = 0;
+            for (int cell = range.start; cell < range.end; ++cell)
+            {
+                while (level+1 < nlevels && vGrids[level+1].firstCell <= cell)
+                    ++level;
+                const LevelGrid &grid = vGrids[level];
+                const int i = (cell-grid.firstCell)/grid.nCols;
+                const int j = (cell-grid.firstCell)%grid.nCols;
 
-            const int nCols = width/W;
-            const int nRows = height/W;
-            const int wCell = ceil(width/nCols);
-            const int hCell = ceil(height/nRows);
+                const float iniY =grid.minBorderY+i*grid.hCell;
+                float maxY = iniY+grid.hCell+6;
 
-            for(int i=0; i<nRows; i++)
-            {
-                const float iniY =minBorderY+i*hCell;
-                float maxY = iniY+hCell+6;
+                if(iniY>=grid.maxBorderY-3)
+                    continue;
+                if(maxY>grid.maxBorderY)
+                    maxY = grid.maxBorderY;
 
-                if(iniY>=maxBorderY-3)
+                const float iniX =grid.minBorderX+j*grid.wCell;
+                float maxX = iniX+grid.wCell+6;
+                if(iniX>=grid.maxBorderX-6)
                     continue;
-                if(maxY>maxBorderY)
-                    maxY = maxBorderY;
+                if(maxX>grid.maxBorderX)
+                    maxX = grid.maxBorderX;
 
-                for(int j=0; j<nCols; j++)
-                {
-                    const float iniX =minBorderX+j*wCell;
-                    float maxX = iniX+wCell+6;
-                    if(iniX>=maxBorderX-6)
-                        continue;
-                    if(maxX>maxBorderX)
-                        maxX = maxBorderX;
+                vector<cv::KeyPoint> &vKeysCell = vCellKeys[cell];
 
-                    vector<cv::KeyPoint> vKeysCell;
+                FAST(mvImagePyramid[level].rowRange(iniY,maxY).colRange(iniX,maxX),
+                     vKeysCell,iniThFAST,true);
 
+                if(vKeysCell.empty())
+                {
                     FAST(mvImagePyramid[level].rowRange(iniY,maxY).colRange(iniX,maxX),
-                         vKeysCell,iniThFAST,true);
+                         vKeysCell,minThFAST,true);
+                }
 
-                    /*if(bRight && j <= 13){
-                        FAST(mvImagePyramid[level].rowRange(iniY,maxY).colRange(iniX,maxX),
-                             vKeysCell,10,true);
-                    }
-                    else if(!bRight && j >= 16){
-                        FAST(mvImagePyramid[level].rowRange(iniY,maxY).colRange(iniX,maxX),
-                             vKeysCell,10,true);
-                    }
-                    else{
-                        FAST(mvImagePyramid[level].rowRange(iniY,maxY).colRange(iniX,maxX),
-                             vKeysCell,iniThFAST,true);
-                    }*/
+                for(vector<cv::KeyPoint>::iterator vit=vKeysCell.begin(); vit!=vKeysCell.end();vit++)
+                {
+                    (*vit).pt.x+=j*grid.wCell;
+                    (*vit).pt.y+=i*grid.hCell;
+                }
+            }
+        };
 
+        // Cells are gathered in the same order as the serial version, so the result does not depend on threads
+        auto distributeLevels = [&](const Range& range)
+        {
+            for (int level = range.start; level < range.end; ++level)
+            {
+                const LevelGrid &grid = vGrids[level];
 
-                    if(vKeysCell.empty())
-                    {
-                        FAST(mvImagePyramid[level].rowRange(iniY,maxY).colRange(iniX,maxX),
-                             vKeysCell,minThFAST,true);
-                        /*if(bRight && j <= 13){
-                            FAST(mvImagePyramid[level].rowRange(iniY,maxY).colRange(iniX,maxX),
-                                 vKeysCell,5,true);
-                        }
-                        else if(!bRight && j >= 16){
-                            FAST(mvImagePyramid[level].rowRange(iniY,maxY).colRange(iniX,maxX),
-                                 vKeysCell,5,true);
-                        }
-                        else{
-                            FAST(mvImagePyramid[level].rowRange(iniY,maxY).colRange(iniX,maxX),
-                                 vKeysCell,minThFAST,true);
-                        }*/
-                    }
+                vector<cv::KeyPoint> vLocalKeys;
+                vector<cv::KeyPoint> & vToDistributeKeys = mbReuseBuffers ? mvToDistributeKeys[level] : vLocalKeys;
+                vToDistributeKeys.clear();
+                vToDistributeKeys.reserve(nfeatures*10);
 
-                    if(!vKeysCell.empty())
-                    {
-                        for(vector<cv::KeyPoint>::iterator vit=vKeysCell.begin(); vit!=vKeysCell.end();vit++)
-                        {
-                            (*vit).pt.x+=j*wCell;
-                            (*vit).pt.y+=i*hCell;
-                            vToDistributeKeys.push_back(*vit);
-                        }
-                    }
+                const int lastCell = grid.firstCell + grid.nRows*grid.nCols;
+                for (int cell = grid.firstCell; cell < lastCell; ++cell)
+                    vToDistributeKeys.insert(vToDistributeKeys.end(), vCellKeys[cell].begin(), vCellKeys[cell].end());
 
-                }
-            }
+                vector<KeyPoint> & keypoints = allKeypoints[level];
+                keypoints.reserve(nfeatures);
 
-            vector<KeyPoint> & keypoints = allKeypoints[level];
-            keypoints.reserve(nfeatures);
+                keypoints = DistributeOctTree(vToDistributeKeys, grid.minBorderX, grid.maxBorderX,
+                                              grid.minBorderY, grid.maxBorderY,mnFeaturesPerLevel[level], level);
 
-            keypoints = DistributeOctTree(vToDistributeKeys, minBorderX, maxBorderX,
-                                          minBorderY, maxBorderY,mnFeaturesPerLevel[level], level);
+                const int scaledPatchSize = PATCH_SIZE*mvScaleFactor[level];
 
-            const int scaledPatchSize = PATCH_SIZE*mvScaleFactor[level];
+                // Add border to coordinates and scale information
+                const int nkps = keypoints.size();
+                for(int i=0; i<nkps ; i++)
+                {
+                    keypoints[i].pt.x+=grid.minBorderX;
+                    keypoints[i].pt.y+=grid.minBorderY;
+                    keypoints[i].octave=level;
+                    keypoints[i].size = scaledPatchSize;
+                }
 
-            // Add border to coordinates and scale information
-            const int nkps = keypoints.size();
-            for(int i=0; i<nkps ; i++)
-            {
-                keypoints[i].pt.x+=minBorderX;
-                keypoints[i].pt.y+=minBorderY;
-                keypoints[i].octave=level;
-                keypoints[i].size = scaledPatchSize;
+                // compute orientations
+                if (angle)
+                {
+                    const int64 start = mbTimeStages ? getTickCount() : 0;
+                    computeOrientation(mvImagePyramid[level], keypoints, umax, mbSimd ? mpAngleWeights.get() : nullptr);
+                    if (mbTimeStages)
+                        mvOrientationTicks[level] += getTickCount() - start;
+                }
             }
-        }
+        };
 
-        // compute orientations
-        if (angle) {
-            for (int level = 0; level < nlevels; ++level)
-                computeOrientation(mvImagePyramid[level], allKeypoints[level], umax);
+        if (mbParallel)
+        {
+            parallel_for_(Range(0, nCells), detectCells);
+            parallel_for_(Range(0, nlevels), distributeLevels, nlevels);
+        }
+        else
+        {
+            detectCells(Range(0, nCells));
+            distributeLevels(Range(0, nlevels));
         }
     }
 
@@ -1055,16 +1104,33 @@ namespace ORB_SLAM3
 
         // and compute orientations
         for (int level = 0; level < nlevels; ++level)
-            computeOrientation(mvImagePyramid[level], allKeypoints[level], umax);
+            computeOrientation(mvImagePyramid[level], allKeypoints[level], umax, mbSimd ? mpAngleWeights.get() : nullptr);
     }
 
-    static void computeDescriptors(const Mat& image, vector<KeyPoint>& keypoints, Mat& descriptors,
-                                   const vector<Point>& pattern)
+    // table is only given when the SIMD kernels are enabled, then all keypoints are computed together
+    static void computeDescriptors(const vector<KeyPoint>& keypoints, const Mat& image, const vector<Point>& pattern,
+                                   const simd::PatternTable* table, const vector<uchar*>& desc)
     {
-        descriptors = Mat::zeros((int)keypoints.size(), 32, CV_8UC1);
+        if (!table)
+        {
+            for (size_t k = 0; k < keypoints.size(); ++k)
+                computeOrbDescriptor(keypoints[k], image, &pattern[0], desc[k]);
+            return;
+        }
 
-        for (size_t i = 0; i < keypoints.size(); i++)
-            computeOrbDescriptor(keypoints[i], image, &pattern[0], descriptors.ptr((int)i));
+        const int n = (int)keypoints.size();
+        vector<int> centers(n);
+        vector<float> a(n), b(n);
+        for (int k = 0; k < n; ++k)
+        {
+            // same as computeOrbDescriptor
+            float angle = (float)keypoints[k].angle*factorPI;
+            a[k] = (float)cos(angle);
+            b[k] = (float)sin(angle);
+            centers[k] = cvRound(keypoints[k].pt.y)*(int)image.step + cvRound(keypoints[k].pt.x);
+        }
+        simd::ComputeOrbDescriptors(image.ptr(), (int)image.step, n, centers.data(), a.data(), b.data(),
+                                    *table, desc.data());
     }
 
     int ORBextractor::operator()( InputArray _image, InputArray _mask, vector<KeyPoint>& _keypoints,
@@ -1077,12 +1143,35 @@ namespace ORB_SLAM3
         Mat image = _image.getMat();
         assert(image.type() == CV_8UC1 );
 
+        int64 ticks = mbTimeStages ? getTickCount() : 0;
+        // Add the ticks since the last call to a stage
+        auto lap = [&](int stage)
+        {
+            if (!mbTimeStages)
+                return;
+            const int64 now = getTickCount();
+            mvStageTicks[stage] += now - ticks;
+            ticks = now;
+        };
+
         // Pre-compute the scale pyramid
         ComputePyramid(image);
+        lap(STAGE_PYRAMID);
 
         vector < vector<KeyPoint> > allKeypoints;
+        int64 orientationTicks = 0;
+        for (int level = 0; level < nlevels; ++level)
+            orientationTicks -= mvOrientationTicks[level];
         ComputeKeyPointsOctTree(allKeypoints);
         //ComputeKeyPointsOld(allKeypoints);
+        for (int level = 0; level < nlevels; ++level)
+            orientationTicks += mvOrientationTicks[level];
+        lap(STAGE_KEYPOINTS);
+        if (mbTimeStages)
+        {
+            mvStageTicks[STAGE_ORIENTATION] += orientationTicks;
+            mvStageTicks[STAGE_KEYPOINTS] -= std::min(orientationTicks, mvStageTicks[STAGE_KEYPOINTS]);
+        }
 
         Mat descriptors;
 
@@ -1101,7 +1190,9 @@ namespace ORB_SLAM3
         //_keypoints.reserve(nkeypoints);
         _keypoints = vector<cv::KeyPoint>(nkeypoints);
 
-        int offset = 0;
+        const simd::PatternTable* table = mbSimd ? mpPatternTable.get() : nullptr;
+        vector<uchar*> vDescriptorRows;
+
         //Modified for speeding up stereo fisheye matching
         int monoIndex = 0, stereoIndex = nkeypoints-1;
         for (int level = 0; level < nlevels; ++level)
@@ -1113,44 +1204,130 @@ namespace ORB_SLAM3
                 continue;
 
             // preprocess the resized image
-            Mat workingMat = mvImagePyramid[level].clone();
-            GaussianBlur(workingMat, workingMat, Size(7, 7), 2, 2, BORDER_REFLECT_101);
-
-            // Compute the descriptors
-            //Mat desc = descriptors.rowRange(offset, offset + nkeypointsLevel);
-            Mat desc = cv::Mat(nkeypointsLevel, 32, CV_8U);
-            computeDescriptors(workingMat, keypoints, desc, pattern);
-
-            offset += nkeypointsLevel;
-
+            // BORDER_ISOLATED keeps the result identical when workingMat is a view of a larger buffer
+            Mat workingMat;
+            if (mbBlurTiles)
+                BlurKeypointTiles(level, keypoints, workingMat);
+            else
+            {
+                if (mbReuseBuffers)
+                {
+                    workingMat = ReuseBuffer(mWorkingBuffer, mvImagePyramid[level].size(), mvImagePyramid[level].type());
+                    mvImagePyramid[level].copyTo(workingMat);
+                }
+                else
+                    workingMat = mvImagePyramid[level].clone();
+                GaussianBlur(workingMat, workingMat, Size(7, 7), 2, 2, BORDER_REFLECT_101+BORDER_ISOLATED);
+            }
+            lap(STAGE_BLUR);
 
+            // Compute the descriptors straight into their output rows
             float scale = mvScaleFactor[level]; //getScale(level, firstLevel, scaleFactor);
-            int i = 0;
-            for (vector<KeyPoint>::iterator keypoint = keypoints.begin(),
-                         keypointEnd = keypoints.end(); keypoint != keypointEnd; ++keypoint){
+            vDescriptorRows.resize(nkeypointsLevel);
+            for (int k = 0; k < nkeypointsLevel; ++k){
 
                 // Scale keypoint coordinates
+                KeyPoint scaled = keypoints[k];
                 if (level != 0){
-                    keypoint->pt *= scale;
+                    scaled.pt *= scale;
                 }
 
-                if(keypoint->pt.x >= vLappingArea[0] && keypoint->pt.x <= vLappingArea[1]){
-                    _keypoints.at(stereoIndex) = (*keypoint);
-                    desc.row(i).copyTo(descriptors.row(stereoIndex));
-                    stereoIndex--;
-                }
-                else{
-                    _keypoints.at(monoIndex) = (*keypoint);
-                    desc.row(i).copyTo(descriptors.row(monoIndex));
-                    monoIndex++;
-                }
-                i++;
+                int index;
+                if(scaled.pt.x >= vLappingArea[0] && scaled.pt.x <= vLappingArea[1])
+                    index = stereoIndex--;
+                else
+                    index = monoIndex++;
+
+                vDescriptorRows[k] = descriptors.ptr(index);
+                _keypoints.at(index) = scaled;
             }
+            // descriptors are computed on the level, before scaling
+            computeDescriptors(keypoints, workingMat, pattern, table, vDescriptorRows);
+            lap(STAGE_DESCRIPTORS);
         }
         //cout << "[ORBextractor]: extracted " << _keypoints.size() << " KeyPoints" << endl;
         return monoIndex;
     }
 
+    void ORBextractor::CopySettingsToWorkers()
+    {
+        for (size_t i = 0; i < mvBatchWorkers.size(); ++i)
+            CopySettingsTo(mvBatchWorkers[i]);
+    }
+
+    void ORBextractor::CopySettingsTo(ORBextractor& worker) const
+    {
+        worker.mbReuseBuffers = mbReuseBuffers;
+        worker.mbParallel = mbParallel;
+        worker.mbBlurTiles = mbBlurTiles;
+        worker.mbTimeStages = mbTimeStages;
+        worker.mbSimd = mbSimd;
+    }
+
+    vector<double> ORBextractor::TakeStageTimes()
+    {
+        vector<double> times(NSTAGES);
+        for (int stage = 0; stage < NSTAGES; ++stage)
+            times[stage] = (double)mvStageTicks[stage] / getTickFrequency();
+        mvStageTicks.assign(NSTAGES, 0);
+        // images of ExtractBatch are timed by the workers
+        for (size_t i = 0; i < mvBatchWorkers.size(); ++i)
+        {
+            vector<double> workerTimes = mvBatchWorkers[i].TakeStageTimes();
+            for (int stage = 0; stage < NSTAGES; ++stage)
+                times[stage] += workerTimes[stage];
+        }
+        return times;
+    }
+
+    void ORBextractor::ExtractBatch(const vector<Mat>& images, OutputArray _descriptors, vector<int>& offsets)
+    {
+        const int nimages = (int)images.size();
+        vector<Mat> vDescriptors(nimages);
+
+        // The pyramid lives inside the extractor, so every stripe works on its own extractor.
+        // They are kept between calls so that their buffers can be reused.
+        const int nstripes = std::max(1, std::min(nimages, getNumThreads()));
+        while ((int)mvBatchWorkers.size() < nstripes)
+        {
+            mvBatchWorkers.emplace_back(nfeatures, (float)scaleFactor, nlevels, iniThFAST, minThFAST, interpolation, angle);
+            CopySettingsTo(mvBatchWorkers.back());
+        }
+        std::atomic<int> next(0);
+
+        parallel_for_(Range(0, nstripes), [&](const Range& range)
+        {
+            vector<int> vLappingArea = {0, 0};
+            vector<KeyPoint> keypoints;
+            for (int stripe = range.start; stripe < range.end; ++stripe)
+            {
+                ORBextractor& worker = mvBatchWorkers[stripe];
+                for (int i = next++; i < nimages; i = next++)
+                    worker(images[i], noArray(), keypoints, vDescriptors[i], vLappingArea);
+            }
+        }, nstripes);
+
+        offsets.resize(nimages + 1);
+        offsets[0] = 0;
+        for (int i = 0; i < nimages; ++i)
+            offsets[i+1] = offsets[i] + vDescriptors[i].rows;
+
+        const int nrows = offsets[nimages];
+        if (nrows == 0)
+        {
+            _descriptors.release();
+            return;
+        }
+
+        _descriptors.create(nrows, 32, CV_8U);
+        Mat descriptors = _descriptors.getMat();
+        for (int i = 0; i < nimages; ++i)
+        {
+            if (vDescriptors[i].rows > 0)
+                vDescriptors[i].copyTo(descriptors.rowRange(offsets[i], offsets[i+1]));
+        }
+    }
+
     void ORBextractor::ComputePyramid(cv::Mat image)
     {
         for (int level = 0; level < nlevels; ++level)
@@ -1158,7 +1335,11 @@ namespace ORB_SLAM3
             float scale = mvInvScaleFactor[level];
             Size sz(cvRound((float)image.cols*scale), cvRound((float)image.rows*scale));
             Size wholeSize(sz.width + EDGE_THRESHOLD*2, sz.height + EDGE_THRESHOLD*2);
-            Mat temp(wholeSize, image.type()), masktemp;
+            Mat temp, masktemp;
+            if (mbReuseBuffers)
+                temp = ReuseBuffer(mvPyramidBuffer[level], wholeSize, image.type());
+            else
+                temp.create(wholeSize, image.type());
             mvImagePyramid[level] = temp(Rect(EDGE_THRESHOLD, EDGE_THRESHOLD, sz.width, sz.height));
 
             // Compute the resized image
@@ -1171,11 +1352,74 @@ namespace ORB_SLAM3
             }
             else
             {
+                // BlurKeypointTiles reads the border, which must reflect the image itself when it is a view
+                // into a larger image. The whole level blur doesn't, so its border is left as it was.
+                const int border = mbBlurTiles ? BORDER_REFLECT_101+BORDER_ISOLATED : BORDER_REFLECT_101;
                 copyMakeBorder(image, temp, EDGE_THRESHOLD, EDGE_THRESHOLD, EDGE_THRESHOLD, EDGE_THRESHOLD,
-                               BORDER_REFLECT_101);
+                               border);
+            }
+        }
+
+    }
+
+    void ORBextractor::BlurKeypointTiles(int level, const vector<KeyPoint>& keypoints, Mat& workingMat)
+    {
+        const Mat& image = mvImagePyramid[level];
+        if (mbReuseBuffers)
+            workingMat = ReuseBuffer(mWorkingBuffer, image.size(), image.type());
+        else
+            workingMat.create(image.size(), image.type());
+
+        // A descriptor samples pixels up to 13*sqrt(2) away from its keypoint, and the 7x7 blur reads 3 more
+        const int TILE = 32, RADIUS = 19, KRADIUS = 3;
+        const int nTilesX = (image.cols + TILE - 1) / TILE;
+        const int nTilesY = (image.rows + TILE - 1) / TILE;
+
+        vector<uchar> vTiles(nTilesX * nTilesY, 0);
+        for (size_t k = 0; k < keypoints.size(); k++)
+        {
+            const int cx = cvRound(keypoints[k].pt.x), cy = cvRound(keypoints[k].pt.y);
+            const int tx0 = std::max(cx - RADIUS, 0) / TILE, tx1 = std::min(cx + RADIUS, image.cols - 1) / TILE;
+            const int ty0 = std::max(cy - RADIUS, 0) / TILE, ty1 = std::min(cy + RADIUS, image.rows - 1) / TILE;
+            for (int ty = ty0; ty <= ty1; ++ty)
+                for (int tx = tx0; tx <= tx1; ++tx)
+                    vTiles[ty * nTilesX + tx] = 1;
+        }
+
+        Mat blurred;
+        for (int ty = 0; ty < nTilesY; ++ty)
+        {
+            for (int tx = 0; tx < nTilesX; ++tx)
+            {
+                if (!vTiles[ty * nTilesX + tx])
+                    continue;
+
+                // blur a whole run of marked tiles at once
+                int end = tx;
+                while (end + 1 < nTilesX && vTiles[ty * nTilesX + end + 1])
+                    ++end;
+                const int x = tx * TILE, y = ty * TILE;
+                Rect roi(x, y, std::min((end + 1) * TILE, image.cols) - x, std::min(y + TILE, image.rows) - y);
+
+                // The pyramid levels are views into images with EDGE_THRESHOLD pixels of BORDER_REFLECT_101 border
+                // of the level itself (for level 0 only in this mode, see ComputePyramid), so growing the view
+                // gives the blur the same neighbourhood as blurring the whole level.
+                // BORDER_ISOLATED keeps GaussianBlur on the bit-exact path used for the whole level.
+                Mat src = image(roi);
+                src.adjustROI(KRADIUS, KRADIUS, KRADIUS, KRADIUS);
+                GaussianBlur(src, blurred, Size(7, 7), 2, 2, BORDER_REFLECT_101+BORDER_ISOLATED);
+                blurred(Rect(KRADIUS, KRADIUS, roi.width, roi.height)).copyTo(workingMat(roi));
+
+                tx = end;
             }
         }
+    }
 
+    Mat ORBextractor::ReuseBuffer(Mat& buffer, Size size, int type)
+    {
+        if (buffer.type() != type || buffer.cols < size.width || buffer.rows < size.height)
+            buffer.create(std::max(buffer.rows, size.height), std::max(buffer.cols, size.width), type);
+        return buffer(Rect(0, 0, size.width, size.height));
     }
 
 } //namespace ORB_SLAM
@@ -21,8 +21,11 @@
 
 #include <vector>
 #include <list>
+#include <memory>
 #include <opencv2/opencv.hpp>
 
+#include "ORBsimd.h"
+
 
 namespace ORB_SLAM3
 {
@@ -46,6 +49,9 @@ public:
     
     enum {HARRIS_SCORE=0, FAST_SCORE=1 };
 
+    // Stages timed by SetTimeStages
+    enum {STAGE_PYRAMID=0, STAGE_KEYPOINTS=1, STAGE_ORIENTATION=2, STAGE_BLUR=3, STAGE_DESCRIPTORS=4, NSTAGES=5 };
+
     ORBextractor(int nfeatures, float scaleFactor, int nlevels,
                  int iniThFAST, int minThFAST, int interpolation, bool angle);
 
@@ -58,6 +64,41 @@ public:
                     std::vector<cv::KeyPoint>& _keypoints,
                     cv::OutputArray _descriptors, std::vector<int> &vLappingArea);
 
+    // Compute the ORB descriptors of a batch of images in parallel.
+    // Descriptors of all images are written to one contiguous matrix, and the descriptors of
+    // image i are rows [offsets[i], offsets[i+1]).
+    void ExtractBatch(const std::vector<cv::Mat>& images, cv::OutputArray _descriptors,
+                      std::vector<int>& offsets);
+
+    // Keep the pyramid and scratch buffers between calls instead of allocating them for every image.
+    // The buffers grow to the largest image seen so far.
+    void inline SetReuseBuffers(bool reuse){
+        mbReuseBuffers = reuse; CopySettingsToWorkers();}
+
+    // Spread the FAST cells and the octree distribution of one image over several threads.
+    // The result is the same as the serial version.
+    void inline SetParallel(bool parallel){
+        mbParallel = parallel; CopySettingsToWorkers();}
+
+    // Only blur the tiles of each level that are sampled by a descriptor, instead of the whole level.
+    // The descriptors are the same as blurring the whole level.
+    void inline SetBlurTiles(bool blurTiles){
+        mbBlurTiles = blurTiles; CopySettingsToWorkers();}
+
+    // Accumulate the time spent in each stage, read with TakeStageTimes.
+    // With SetParallel the orientation time is summed over threads, and the keypoint stage is its wall time minus that.
+    // Images of ExtractBatch are timed by the batch workers, and their times are included.
+    void inline SetTimeStages(bool timeStages){
+        mbTimeStages = timeStages; CopySettingsToWorkers();}
+
+    // Use the SIMD kernels when the CPU has them, which is the default.
+    // The results are the same either way, this only exists to compare both.
+    void inline SetSimd(bool useSimd){
+        mbSimd = useSimd && simd::Enabled(); CopySettingsToWorkers();}
+
+    // Return the seconds spent in each stage since the last call, indexed by STAGE_*
+    std::vector<double> TakeStageTimes();
+
     int inline GetLevels(){
         return nlevels;}
 
@@ -90,6 +131,17 @@ protected:
                                            const int &maxX, const int &minY, const int &maxY, const int &nFeatures, const int &level);
 
     void ComputeKeyPointsOld(std::vector<std::vector<cv::KeyPoint> >& allKeypoints);
+
+    // Return a view of the given size at the top-left of buffer, growing buffer if needed
+    static cv::Mat ReuseBuffer(cv::Mat& buffer, cv::Size size, int type);
+
+    // Blur the tiles of a level around the keypoints into workingMat, other pixels are left undefined
+    void BlurKeypointTiles(int level, const std::vector<cv::KeyPoint>& keypoints, cv::Mat& workingMat);
+
+    // Give the batch workers the settings of this extractor
+    void CopySettingsToWorkers();
+    void CopySettingsTo(ORBextractor& worker) const;
+
     std::vector<cv::Point> pattern;
 
     int nfeatures;
@@ -108,6 +160,22 @@ protected:
     std::vector<float> mvInvScaleFactor;    
     std::vector<float> mvLevelSigma2;
     std::vector<float> mvInvLevelSigma2;
+
+    bool mbReuseBuffers;
+    bool mbParallel;
+    bool mbBlurTiles;
+    bool mbTimeStages;
+    bool mbSimd;
+    // Built once when the SIMD kernels are available, and shared with copies of the extractor
+    std::shared_ptr<const simd::AngleWeights> mpAngleWeights;
+    std::shared_ptr<const simd::PatternTable> mpPatternTable;
+    std::vector<int64> mvStageTicks;
+    // Per level, so that levels distributed in parallel don't share a counter
+    std::vector<int64> mvOrientationTicks;
+    std::vector<cv::Mat> mvPyramidBuffer;
+    std::vector<std::vector<cv::KeyPoint> > mvToDistributeKeys;
+    cv::Mat mWorkingBuffer;
+    std::vector<ORBextractor> mvBatchWorkers;
 };
 
 } //namespace ORB_SLAM
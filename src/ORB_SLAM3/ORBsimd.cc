@@ -0,0 +1,300 @@
+#include "ORBsimd.h"
+
+#include <cstdlib>
+#include <opencv2/core/core.hpp>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ORBSIMD_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define ORBSIMD_NEON
+#endif
+
+namespace ORB_SLAM3
+{
+namespace simd
+{
+
+    const int HALF_PATCH_SIZE = 15;
+
+    enum Level { SIMD_NONE, SIMD_AVX2, SIMD_NEON };
+
+    static Level Detect()
+    {
+        if (std::getenv("ORB_SLAM3_NO_SIMD"))
+            return SIMD_NONE;
+#if defined(ORBSIMD_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return SIMD_AVX2;
+#elif defined(ORBSIMD_NEON)
+        return SIMD_NEON;
+#endif
+        return SIMD_NONE;
+    }
+
+    static Level CurrentLevel()
+    {
+        static const Level level = Detect();
+        return level;
+    }
+
+    bool Enabled()
+    {
+        return CurrentLevel() != SIMD_NONE;
+    }
+
+    AngleWeights::AngleWeights(const std::vector<int>& umax)
+    {
+        for (int row = 0; row <= HALF_PATCH_SIZE; ++row)
+        {
+            // the center line always uses the whole diameter
+            const int d = row == 0 ? HALF_PATCH_SIZE : umax[row];
+            for (int i = 0; i < 32; ++i)
+            {
+                const int du = i - HALF_PATCH_SIZE;
+                const bool inside = du >= -d && du <= d;
+                u[row][i] = inside ? du : 0;
+                v[row][i] = inside ? row : 0;
+            }
+        }
+    }
+
+    PatternTable::PatternTable(const std::vector<cv::Point>& pattern)
+    {
+        CV_Assert(pattern.size() == 512);
+        for (int i = 0; i < 512; ++i)
+        {
+            x[i] = (float)pattern[i].x;
+            y[i] = (float)pattern[i].y;
+        }
+    }
+
+    // Compare the pixels of each point pair, in the same order as computeOrbDescriptor
+    static inline void PackDescriptor(const uchar* center, const int* offsets, uchar* desc)
+    {
+        for (int i = 0; i < 32; ++i, offsets += 16)
+        {
+            int val = 0;
+            for (int k = 0; k < 8; ++k)
+                val |= (center[offsets[2*k]] < center[offsets[2*k+1]]) << k;
+            desc[i] = (uchar)val;
+        }
+    }
+
+#if defined(ORBSIMD_X86)
+
+    __attribute__((target("avx2")))
+    static inline int HorizontalSum(__m256i v)
+    {
+        __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+        return _mm_cvtsi128_si32(s);
+    }
+
+    // Accumulate the dot product of 32 int16 values (lo, hi) and 32 int16 weights at w
+    __attribute__((target("avx2")))
+    static inline __m256i DotBytes(__m256i acc, __m256i lo, __m256i hi, const short* w)
+    {
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)w), lo));
+        return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)(w + 16)), hi));
+    }
+
+    __attribute__((target("avx2")))
+    static float IC_AngleAVX2(const uchar* center, int step, const AngleWeights& weights)
+    {
+        __m256i m_10 = _mm256_setzero_si256(), m_01 = _mm256_setzero_si256();
+
+        // Treat the center line differently, v=0
+        __m256i c = _mm256_loadu_si256((const __m256i*)(center - HALF_PATCH_SIZE));
+        m_10 = DotBytes(m_10, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(c)),
+                        _mm256_cvtepu8_epi16(_mm256_extracti128_si256(c, 1)), weights.u[0]);
+
+        for (int v = 1; v <= HALF_PATCH_SIZE; ++v)
+        {
+            __m256i p = _mm256_loadu_si256((const __m256i*)(center + v*step - HALF_PATCH_SIZE));
+            __m256i m = _mm256_loadu_si256((const __m256i*)(center - v*step - HALF_PATCH_SIZE));
+            __m256i plo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(p));
+            __m256i phi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(p, 1));
+            __m256i mlo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(m));
+            __m256i mhi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(m, 1));
+
+            m_10 = DotBytes(m_10, _mm256_add_epi16(plo, mlo), _mm256_add_epi16(phi, mhi), weights.u[v]);
+            m_01 = DotBytes(m_01, _mm256_sub_epi16(plo, mlo), _mm256_sub_epi16(phi, mhi), weights.v[v]);
+        }
+
+        return cv::fastAtan2((float)HorizontalSum(m_01), (float)HorizontalSum(m_10));
+    }
+
+    __attribute__((target("avx2")))
+    static void ComputeOrbDescriptorAVX2(const uchar* center, int step, float a, float b,
+                                         const PatternTable& pattern, uchar* desc)
+    {
+        alignas(32) int offsets[512];
+        const __m256 va = _mm256_set1_ps(a), vb = _mm256_set1_ps(b);
+        const __m256i vstep = _mm256_set1_epi32(step);
+
+        // mul and add are kept separate (no FMA), exactly like the scalar cvRound(x*b + y*a)
+        for (int i = 0; i < 512; i += 8)
+        {
+            __m256 x = _mm256_loadu_ps(pattern.x + i), y = _mm256_loadu_ps(pattern.y + i);
+            __m256i iy = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(x, vb), _mm256_mul_ps(y, va)));
+            __m256i ix = _mm256_cvtps_epi32(_mm256_sub_ps(_mm256_mul_ps(x, va), _mm256_mul_ps(y, vb)));
+            _mm256_store_si256((__m256i*)(offsets + i), _mm256_add_epi32(_mm256_mullo_epi32(iy, vstep), ix));
+        }
+
+        PackDescriptor(center, offsets, desc);
+    }
+
+    // Pixel of pattern point (px, py) around the 8 keypoints of ComputeOrbDescriptors8AVX2
+    __attribute__((target("avx2")))
+    static inline __m256i GatherPixels(const uchar* data, __m256i vcenter, __m256i vstep,
+                                       __m256 va, __m256 vb, float px, float py)
+    {
+        const __m256 x = _mm256_set1_ps(px), y = _mm256_set1_ps(py);
+        __m256i iy = _mm256_cvtps_epi32(_mm256_add_ps(_mm256_mul_ps(x, vb), _mm256_mul_ps(y, va)));
+        __m256i ix = _mm256_cvtps_epi32(_mm256_sub_ps(_mm256_mul_ps(x, va), _mm256_mul_ps(y, vb)));
+        __m256i offset = _mm256_add_epi32(vcenter, _mm256_add_epi32(_mm256_mullo_epi32(iy, vstep), ix));
+        return _mm256_and_si256(_mm256_i32gather_epi32((const int*)data, offset, 1), _mm256_set1_epi32(0xff));
+    }
+
+    // 8 keypoints at once, lane k is keypoint k. The offsets are computed per lane with the same
+    // operations as ComputeOrbDescriptorAVX2, and both pixels of a pair are gathered for all lanes.
+    // A gather reads 4 bytes, the 3 extra bytes stay inside the image since keypoints are at least
+    // EDGE_THRESHOLD pixels away from its border.
+    __attribute__((target("avx2")))
+    static void ComputeOrbDescriptors8AVX2(const uchar* data, int step, const int* centers,
+                                           const float* a, const float* b, const PatternTable& pattern,
+                                           uchar* const* desc)
+    {
+        const __m256 va = _mm256_loadu_ps(a), vb = _mm256_loadu_ps(b);
+        const __m256i vcenter = _mm256_loadu_si256((const __m256i*)centers);
+        const __m256i vstep = _mm256_set1_epi32(step);
+
+        alignas(32) int bytes[8];
+        for (int i = 0; i < 32; ++i)
+        {
+            __m256i val = _mm256_setzero_si256();
+            for (int k = 0; k < 8; ++k)
+            {
+                const int pair = i * 8 + k;
+                const int p0 = 2*pair, p1 = 2*pair + 1;
+                __m256i t0 = GatherPixels(data, vcenter, vstep, va, vb, pattern.x[p0], pattern.y[p0]);
+                __m256i t1 = GatherPixels(data, vcenter, vstep, va, vb, pattern.x[p1], pattern.y[p1]);
+                // t0 < t1, as in computeOrbDescriptor
+                __m256i bit = _mm256_and_si256(_mm256_cmpgt_epi32(t1, t0), _mm256_set1_epi32(1 << k));
+                val = _mm256_or_si256(val, bit);
+            }
+            _mm256_store_si256((__m256i*)bytes, val);
+            for (int lane = 0; lane < 8; ++lane)
+                desc[lane][i] = (uchar)bytes[lane];
+        }
+    }
+
+#elif defined(ORBSIMD_NEON)
+
+    static inline int32x4_t DotBytes(int32x4_t acc, int16x8_t lo, int16x8_t hi, const short* w)
+    {
+        int16x8_t wlo = vld1q_s16(w), whi = vld1q_s16(w + 8);
+        acc = vmlal_s16(acc, vget_low_s16(wlo), vget_low_s16(lo));
+        acc = vmlal_high_s16(acc, wlo, lo);
+        acc = vmlal_s16(acc, vget_low_s16(whi), vget_low_s16(hi));
+        return vmlal_high_s16(acc, whi, hi);
+    }
+
+    static inline int16x8_t Widen(uint8x8_t v)
+    {
+        return vreinterpretq_s16_u16(vmovl_u8(v));
+    }
+
+    static float IC_AngleNEON(const uchar* center, int step, const AngleWeights& weights)
+    {
+        int32x4_t m_10 = vdupq_n_s32(0), m_01 = vdupq_n_s32(0);
+
+        // Treat the center line differently, v=0
+        for (int half = 0; half < 2; ++half)
+        {
+            uint8x16_t c = vld1q_u8(center - HALF_PATCH_SIZE + half*16);
+            m_10 = DotBytes(m_10, Widen(vget_low_u8(c)), Widen(vget_high_u8(c)), weights.u[0] + half*16);
+        }
+
+        for (int v = 1; v <= HALF_PATCH_SIZE; ++v)
+        {
+            for (int half = 0; half < 2; ++half)
+            {
+                uint8x16_t p = vld1q_u8(center + v*step - HALF_PATCH_SIZE + half*16);
+                uint8x16_t m = vld1q_u8(center - v*step - HALF_PATCH_SIZE + half*16);
+                int16x8_t plo = Widen(vget_low_u8(p)), phi = Widen(vget_high_u8(p));
+                int16x8_t mlo = Widen(vget_low_u8(m)), mhi = Widen(vget_high_u8(m));
+
+                m_10 = DotBytes(m_10, vaddq_s16(plo, mlo), vaddq_s16(phi, mhi), weights.u[v] + half*16);
+                m_01 = DotBytes(m_01, vsubq_s16(plo, mlo), vsubq_s16(phi, mhi), weights.v[v] + half*16);
+            }
+        }
+
+        return cv::fastAtan2((float)vaddvq_s32(m_01), (float)vaddvq_s32(m_10));
+    }
+
+    static void ComputeOrbDescriptorNEON(const uchar* center, int step, float a, float b,
+                                         const PatternTable& pattern, uchar* desc)
+    {
+        alignas(16) int offsets[512];
+        const float32x4_t va = vdupq_n_f32(a), vb = vdupq_n_f32(b);
+        const int32x4_t vstep = vdupq_n_s32(step);
+
+        // requires -ffp-contract=off, so that mul and add are not fused, exactly like the scalar version
+        for (int i = 0; i < 512; i += 4)
+        {
+            float32x4_t x = vld1q_f32(pattern.x + i), y = vld1q_f32(pattern.y + i);
+            int32x4_t iy = vcvtnq_s32_f32(vaddq_f32(vmulq_f32(x, vb), vmulq_f32(y, va)));
+            int32x4_t ix = vcvtnq_s32_f32(vsubq_f32(vmulq_f32(x, va), vmulq_f32(y, vb)));
+            vst1q_s32(offsets + i, vmlaq_s32(ix, iy, vstep));
+        }
+
+        PackDescriptor(center, offsets, desc);
+    }
+
+#endif
+
+    float IC_Angle(const uchar* center, int step, const AngleWeights& weights)
+    {
+#if defined(ORBSIMD_X86)
+        return IC_AngleAVX2(center, step, weights);
+#elif defined(ORBSIMD_NEON)
+        return IC_AngleNEON(center, step, weights);
+#else
+        CV_Error(cv::Error::StsNotImplemented, "no SIMD implementation of IC_Angle");
+#endif
+    }
+
+    void ComputeOrbDescriptor(const uchar* center, int step, float a, float b,
+                              const PatternTable& pattern, uchar* desc)
+    {
+#if defined(ORBSIMD_X86)
+        ComputeOrbDescriptorAVX2(center, step, a, b, pattern, desc);
+#elif defined(ORBSIMD_NEON)
+        ComputeOrbDescriptorNEON(center, step, a, b, pattern, desc);
+#else
+        CV_Error(cv::Error::StsNotImplemented, "no SIMD implementation of computeOrbDescriptor");
+#endif
+    }
+
+    void ComputeOrbDescriptors(const uchar* data, int step, int n, const int* centers,
+                               const float* a, const float* b, const PatternTable& pattern, uchar* const* desc)
+    {
+        int k = 0;
+#if defined(ORBSIMD_X86)
+        for (; k + 8 <= n; k += 8)
+            ComputeOrbDescriptors8AVX2(data, step, centers + k, a + k, b + k, pattern, desc + k);
+#endif
+        // NEON has no gather, every pixel is a scalar load whether keypoints are batched or not, so NEON
+        // stays at one keypoint per iteration, its offsets computed 4 pattern points at a time.
+        // The last keypoints of AVX2 also go one at a time.
+        for (; k < n; ++k)
+            ComputeOrbDescriptor(data + centers[k], step, a[k], b[k], pattern, desc[k]);
+    }
+
+} //namespace simd
+} //namespace ORB_SLAM3
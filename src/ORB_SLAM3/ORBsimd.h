@@ -0,0 +1,58 @@
+#ifndef ORBSIMD_H
+#define ORBSIMD_H
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+// Vectorized versions of the orientation and descriptor kernels of ORBextractor.
+// They are selected at runtime (AVX2 on x86, NEON on aarch64), and every kernel returns exactly the
+// same result as the scalar one, so existing databases stay valid.
+// Set ORB_SLAM3_NO_SIMD in the environment to always use the scalar kernels.
+
+namespace ORB_SLAM3
+{
+namespace simd
+{
+
+// Whether a vectorized implementation is available on this CPU
+bool Enabled();
+
+// The tables are read with unaligned loads, so they may live anywhere on the heap.
+
+// Weights of the circular patch used by IC_Angle, built from umax.
+// Column i of each row stands for u = i - 15, columns outside of the circle are zero.
+struct AngleWeights
+{
+    explicit AngleWeights(const std::vector<int>& umax);
+
+    alignas(32) short u[16][32];
+    alignas(32) short v[16][32];
+};
+
+// The 512 points of the BRIEF pattern, converted to float
+struct PatternTable
+{
+    explicit PatternTable(const std::vector<cv::Point>& pattern);
+
+    alignas(32) float x[512];
+    alignas(32) float y[512];
+};
+
+// center points to the keypoint pixel, step is the row step in bytes
+float IC_Angle(const uchar* center, int step, const AngleWeights& weights);
+
+// a and b are the cosine and sine of the keypoint angle
+void ComputeOrbDescriptor(const uchar* center, int step, float a, float b,
+                          const PatternTable& pattern, uchar* desc);
+
+// Descriptors of n keypoints of one image. centers[k] is the offset of keypoint k from data,
+// a[k] and b[k] the cosine and sine of its angle, and desc[k] its output row.
+// With AVX2, 8 keypoints are compared per iteration, one lane each. NEON has no gather, so it
+// computes one keypoint per iteration like ComputeOrbDescriptor.
+void ComputeOrbDescriptors(const uchar* data, int step, int n, const int* centers,
+                           const float* a, const float* b, const PatternTable& pattern, uchar* const* desc);
+
+} //namespace simd
+} //namespace ORB_SLAM3
+
+#endif
@@ -12,6 +12,32 @@ void slam3_ORB_delete(ORB_SLAM3::ORBextractor *self) {
     delete self;
 }
 
+void slam3_ORB_set_reuse_buffers(ORB_SLAM3::ORBextractor *self, bool reuse) {
+    self->SetReuseBuffers(reuse);
+}
+
+void slam3_ORB_set_parallel(ORB_SLAM3::ORBextractor *self, bool parallel) {
+    self->SetParallel(parallel);
+}
+
+void slam3_ORB_set_blur_tiles(ORB_SLAM3::ORBextractor *self, bool blur_tiles) {
+    self->SetBlurTiles(blur_tiles);
+}
+
+void slam3_ORB_set_simd(ORB_SLAM3::ORBextractor *self, bool simd) {
+    self->SetSimd(simd);
+}
+
+void slam3_ORB_set_time_stages(ORB_SLAM3::ORBextractor *self, bool time_stages) {
+    self->SetTimeStages(time_stages);
+}
+
+// times must hold ORBextractor::NSTAGES doubles
+void slam3_ORB_take_stage_times(ORB_SLAM3::ORBextractor *self, double *times) {
+    std::vector<double> stageTimes = self->TakeStageTimes();
+    std::copy(stageTimes.begin(), stageTimes.end(), times);
+}
+
 Result_void slam3_ORB_detect_and_compute(ORB_SLAM3::ORBextractor *self, cv::InputArray _image, cv::InputArray _mask,
                                   std::vector<cv::KeyPoint> &_keypoints,
                                   cv::OutputArray _descriptors, std::vector<int> &vLappingArea) {
@@ -20,4 +46,12 @@ Result_void slam3_ORB_detect_and_compute(ORB_SLAM3::ORBextractor *self, cv::Inpu
         return Ok();
     } OCVRS_CATCH(Result_void)
 }
+
+Result_void slam3_ORB_detect_and_compute_batch(ORB_SLAM3::ORBextractor *self, std::vector<cv::Mat> &images,
+                                               cv::OutputArray _descriptors, std::vector<int> &offsets) {
+    try {
+        self->ExtractBatch(images, _descriptors, offsets);
+        return Ok();
+    } OCVRS_CATCH(Result_void)
+}
 }
\ No newline at end of file
@@ -0,0 +1,122 @@
+use std::sync::mpsc::{self, Receiver, Sender};
+use std::sync::{Arc, Mutex, RwLock};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use crate::index::{MultiFaissIndex, Neighbor, SearchBuffer};
+use crate::matrix::{Matrix, Matrix2D};
+use anyhow::{anyhow, Result};
+use log::debug;
+use rayon::ThreadPool;
+
+struct Job {
+    width: usize,
+    descriptors: Vec<u8>,
+    reply: Sender<Vec<Neighbor>>,
+}
+
+/// Collect the descriptors of concurrent queries, and search them in a single call
+///
+/// A batch is sent when `max_queries` queries are collected or `window` has passed since its first query
+pub struct SearchBatcher {
+    sender: Mutex<Sender<Job>>,
+}
+
+impl SearchBatcher {
+    pub fn new(
+        index: Arc<RwLock<MultiFaissIndex>>,
+        pool: Arc<ThreadPool>,
+        knn: usize,
+        window: Duration,
+        max_queries: usize,
+    ) -> Self {
+        let (sender, receiver) = mpsc::channel();
+        thread::Builder::new()
+            .name("search-batcher".to_owned())
+            .spawn(move || run(receiver, index, pool, knn, window, max_queries.max(1)))
+            .expect("failed to spawn search batcher");
+        Self {
+            sender: Mutex::new(sender),
+        }
+    }
+
+    /// Search the neighbors of all descriptors, together with other queries of the same batch
+    pub fn search<M: Matrix>(&self, descriptors: &M) -> Result<Vec<Neighbor>> {
+        if descriptors.height() == 0 {
+            return Ok(vec![]);
+        }
+        // SAFETY: a Matrix is a continuous array of height * width bytes
+        let data = unsafe {
+            std::slice::from_raw_parts(
+                descriptors.as_ptr(),
+                descriptors.width() * descriptors.height(),
+            )
+        };
+
+        let (reply, result) = mpsc::channel();
+        let job = Job {
+            width: descriptors.width(),
+            descriptors: data.to_vec(),
+            reply,
+        };
+        let sender = self.sender.lock().unwrap().clone();
+        sender
+            .send(job)
+            .map_err(|_| anyhow!("search batcher stopped"))?;
+        result.recv().map_err(|_| anyhow!("search batcher stopped"))
+    }
+}
+
+fn run(
+    receiver: Receiver<Job>,
+    index: Arc<RwLock<MultiFaissIndex>>,
+    pool: Arc<ThreadPool>,
+    knn: usize,
+    window: Duration,
+    max_queries: usize,
+) {
+    let mut buffer = SearchBuffer::default();
+
+    while let Ok(first) = receiver.recv() {
+        let deadline = Instant::now() + window;
+        let mut jobs = vec![first];
+        while jobs.len() < max_queries {
+            let timeout = deadline.saturating_duration_since(Instant::now());
+            match receiver.recv_timeout(timeout) {
+                Ok(job) => jobs.push(job),
+                Err(_) => break,
+            }
+        }
+
+        let width = jobs[0].width;
+        let rows = jobs
+            .iter()
+            .map(|job| job.descriptors.len() / job.width)
+            .sum::<usize>();
+        let mut points = Matrix2D::with_capacity(width, rows);
+        for job in jobs.iter() {
+            assert_eq!(job.width, width);
+            for line in job.descriptors.chunks(width) {
+                points.push(line);
+            }
+        }
+        debug!(
+            "searching a batch of {} queries, {} points",
+            jobs.len(),
+            rows
+        );
+
+        pool.install(|| {
+            let index = index.read().expect("failed to acquire rw lock");
+            let result = index.search(&points, knn, &mut buffer);
+            let mut start = 0;
+            for job in jobs {
+                let end = start + job.descriptors.len() / width;
+                let neighbors = (start..end).flat_map(|i| result.row(i)).collect();
+                start = end;
+                // the query may have been dropped
+                let _ = job.reply.send(neighbors);
+            }
+        });
+    }
+}
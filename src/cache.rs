@@ -0,0 +1,130 @@
+use std::collections::{BTreeMap, HashMap};
+use std::hash::Hash;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Mutex;
+
+struct Entries<K, V> {
+    map: HashMap<K, (V, u64)>,
+    /// Keys by the time they were last used, the first one is evicted
+    order: BTreeMap<u64, K>,
+    tick: u64,
+}
+
+/// A thread safe LRU cache holding at most `capacity` entries, 0 disables it
+///
+/// Values are cloned out of the cache, so large values should be wrapped in an `Arc`
+pub struct LruCache<K, V> {
+    capacity: usize,
+    entries: Mutex<Entries<K, V>>,
+    hits: AtomicU64,
+    misses: AtomicU64,
+}
+
+impl<K: Hash + Eq + Clone, V: Clone> LruCache<K, V> {
+    pub fn new(capacity: usize) -> Self {
+        Self {
+            capacity,
+            entries: Mutex::new(Entries {
+                map: HashMap::new(),
+                order: BTreeMap::new(),
+                tick: 0,
+            }),
+            hits: AtomicU64::new(0),
+            misses: AtomicU64::new(0),
+        }
+    }
+
+    pub fn is_enabled(&self) -> bool {
+        self.capacity != 0
+    }
+
+    pub fn get(&self, key: &K) -> Option<V> {
+        if !self.is_enabled() {
+            return None;
+        }
+        let mut entries = self.entries.lock().unwrap();
+        let entries = &mut *entries;
+        entries.tick += 1;
+        let tick = entries.tick;
+        match entries.map.get_mut(key) {
+            Some((value, used)) => {
+                let key = entries.order.remove(used).expect("broken lru order");
+                entries.order.insert(tick, key);
+                *used = tick;
+                self.hits.fetch_add(1, Ordering::Relaxed);
+                Some(value.clone())
+            }
+            None => {
+                self.misses.fetch_add(1, Ordering::Relaxed);
+                None
+            }
+        }
+    }
+
+    pub fn insert(&self, key: K, value: V) {
+        if !self.is_enabled() {
+            return;
+        }
+        let mut entries = self.entries.lock().unwrap();
+        let entries = &mut *entries;
+        entries.tick += 1;
+        let tick = entries.tick;
+        if let Some((_, used)) = entries.map.insert(key.clone(), (value, tick)) {
+            entries.order.remove(&used);
+        }
+        entries.order.insert(tick, key);
+
+        while entries.map.len() > self.capacity {
+            let oldest = *entries.order.keys().next().expect("broken lru order");
+            let key = entries.order.remove(&oldest).expect("broken lru order");
+            entries.map.remove(&key);
+        }
+    }
+
+    pub fn clear(&self) {
+        let mut entries = self.entries.lock().unwrap();
+        entries.map.clear();
+        entries.order.clear();
+    }
+
+    pub fn len(&self) -> usize {
+        self.entries.lock().unwrap().map.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Number of hits and misses so far
+    pub fn stats(&self) -> (u64, u64) {
+        (
+            self.hits.load(Ordering::Relaxed),
+            self.misses.load(Ordering::Relaxed),
+        )
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::LruCache;
+
+    #[test]
+    fn lru_cache() {
+        let cache = LruCache::new(2);
+        cache.insert(1, "a");
+        cache.insert(2, "b");
+        assert_eq!(cache.get(&1), Some("a"));
+        // 2 is the least recently used
+        cache.insert(3, "c");
+        assert_eq!(cache.get(&2), None);
+        assert_eq!(cache.get(&1), Some("a"));
+        assert_eq!(cache.get(&3), Some("c"));
+        assert_eq!(cache.stats(), (3, 1));
+
+        cache.clear();
+        assert!(cache.is_empty());
+        let disabled = LruCache::new(0);
+        disabled.insert(1, "a");
+        assert_eq!(disabled.get(&1), None);
+    }
+}
@@ -0,0 +1,227 @@
+use std::path::PathBuf;
+use std::time::{Duration, Instant};
+
+use crate::cmd::SubCommandExtend;
+use crate::config::{ConfDir, Opts};
+use crate::db::ImageDB;
+use crate::index::{Neighbor, SearchBuffer};
+use crate::matrix::{Matrix, Matrix2D};
+use crate::slam3_orb::{Slam3ORB, StageTimes};
+use crate::utils::{self, SplitMix64};
+use crate::IMDB;
+use anyhow::Result;
+use opencv::prelude::*;
+use opencv::{core, imgproc};
+use structopt::StructOpt;
+
+#[derive(StructOpt, Debug, Clone)]
+pub struct Benchmark {
+    /// Number of synthetic images
+    #[structopt(long, value_name = "N", default_value = "200")]
+    pub images: usize,
+    /// Width of the synthetic images
+    #[structopt(long, default_value = "1024")]
+    pub width: i32,
+    /// Height of the synthetic images
+    #[structopt(long, default_value = "768")]
+    pub height: i32,
+    /// Index trained on the synthetic features
+    #[structopt(long, value_name = "DESCRIPTION", default_value = "BIVF1024")]
+    pub description: String,
+    /// Search with each of these nprobe
+    #[structopt(long, use_delimiter = true, default_value = "1,4,16,64")]
+    pub nprobe: Vec<usize>,
+    /// Number of images searched for each nprobe
+    #[structopt(long, value_name = "N", default_value = "50")]
+    pub queries: usize,
+    /// Seed of the synthetic images
+    #[structopt(long, default_value = "0")]
+    pub seed: u64,
+    /// Build the database in this empty directory and keep it, instead of a temporary one
+    #[structopt(long, value_name = "DIR")]
+    pub dir: Option<String>,
+}
+
+/// Draw random rectangles, circles and lines, so that every image has different features
+fn synthetic_image(width: i32, height: i32, seed: u64) -> Result<Mat> {
+    let mut rng = SplitMix64::new(seed);
+    let mut uniform = |n: i32| (rng.next_u64() % n.max(1) as u64) as i32;
+    let mut image = Mat::new_rows_cols_with_default(
+        height,
+        width,
+        core::CV_8UC1,
+        core::Scalar::all(uniform(256) as f64),
+    )?;
+    for _ in 0..80 {
+        let color = core::Scalar::all(uniform(256) as f64);
+        let point = core::Point::new(uniform(width), uniform(height));
+        let size = uniform(width / 8) + 4;
+        match uniform(3) {
+            0 => imgproc::rectangle(
+                &mut image,
+                core::Rect::new(point.x, point.y, size, uniform(height / 8) + 4),
+                color,
+                -1,
+                imgproc::LINE_8,
+                0,
+            )?,
+            1 => imgproc::circle(&mut image, point, size / 2, color, -1, imgproc::LINE_AA, 0)?,
+            _ => imgproc::line(
+                &mut image,
+                point,
+                core::Point::new(uniform(width), uniform(height)),
+                color,
+                uniform(4) + 1,
+                imgproc::LINE_AA,
+                0,
+            )?,
+        }
+    }
+    Ok(image)
+}
+
+fn per_item(duration: Duration, n: usize) -> f64 {
+    duration.as_secs_f64() * 1000.0 / n.max(1) as f64
+}
+
+impl SubCommandExtend for Benchmark {
+    fn run(&self, opts: &Opts) -> Result<()> {
+        let tmp_dir;
+        let dir = match &self.dir {
+            Some(dir) => PathBuf::from(dir),
+            None => {
+                tmp_dir = tempfile::tempdir()?;
+                tmp_dir.path().to_path_buf()
+            }
+        };
+        std::fs::create_dir_all(&dir)?;
+        let conf_dir: ConfDir = dir.to_string_lossy().parse().unwrap();
+
+        println!(
+            "{} synthetic {}x{} images in {}",
+            self.images,
+            self.width,
+            self.height,
+            dir.display()
+        );
+        let images = (0..self.images)
+            .map(|i| synthetic_image(self.width, self.height, self.seed.wrapping_add(i as u64)))
+            .collect::<Result<Vec<_>>>()?;
+
+        // extraction, one image at a time so the stages can be told apart
+        let mut orb = Slam3ORB::from(opts);
+        orb.set_time_stages(true);
+        let start = Instant::now();
+        let descriptors = images
+            .iter()
+            .map(|image| {
+                let (_, descriptors) = utils::detect_and_compute(&mut orb, image)?;
+                Ok(Matrix2D::from_matrix(&descriptors))
+            })
+            .collect::<Result<Vec<_>>>()?;
+        let elapsed = start.elapsed();
+        let stages = orb.take_stage_times();
+        let features = descriptors.iter().map(|d| d.height()).sum::<usize>();
+        println!(
+            "extract:     {:8.3} ms/image, {} features",
+            per_item(elapsed, images.len()),
+            features
+        );
+        let StageTimes {
+            pyramid,
+            keypoints,
+            orientation,
+            blur,
+            descriptors: compute,
+        } = stages;
+        for (name, seconds) in [
+            ("pyramid", pyramid),
+            ("fast+octree", keypoints),
+            ("orientation", orientation),
+            ("blur", blur),
+            ("descriptors", compute),
+        ]
+        .iter()
+        {
+            println!(
+                "  {:<12} {:8.3} ms/image, {:5.1}%",
+                name,
+                seconds * 1000.0 / images.len().max(1) as f64,
+                seconds / stages.total().max(f64::MIN_POSITIVE) * 100.0
+            );
+        }
+
+        // ingestion of precomputed features, so only the database is measured
+        let paths = (0..images.len())
+            .map(|i| format!("synthetic/{:05}.png", i))
+            .collect::<Vec<_>>();
+        {
+            let db = ImageDB::open(&conf_dir, false)?;
+            let start = Instant::now();
+            for ((path, image), descriptors) in paths.iter().zip(&images).zip(&descriptors) {
+                // SAFETY: a Matrix is a continuous array of height * width bytes
+                let data = unsafe {
+                    std::slice::from_raw_parts(image.as_ptr(), image.width() * image.height())
+                };
+                db.add_image(path, blake3::hash(data).as_bytes(), descriptors)?;
+            }
+            db.sync()?;
+            println!(
+                "add_image:   {:8.3} ms/image",
+                per_item(start.elapsed(), images.len())
+            );
+        }
+
+        let db = IMDB::new(conf_dir.clone(), false)?;
+        let start = Instant::now();
+        db.train_index(Some(self.description.as_str()), None, None, self.seed)?;
+        println!("train:       {:8.3} s", start.elapsed().as_secs_f64());
+        let start = Instant::now();
+        db.build_index(opts.batch_size, None, None, false)?;
+        let elapsed = start.elapsed();
+        println!(
+            "build_index: {:8.0} features/s",
+            features as f64 / elapsed.as_secs_f64()
+        );
+
+        // searching the images themselves, each should find itself first
+        drop(db);
+        let db = IMDB::new(conf_dir, true)?;
+        let mut index = db.get_multi_index(false);
+        let step = (images.len() / self.queries.max(1)).max(1);
+        let queries = (0..images.len())
+            .step_by(step)
+            .take(self.queries)
+            .collect::<Vec<_>>();
+        let mut buffer = SearchBuffer::default();
+        for &nprobe in self.nprobe.iter() {
+            index.set_nprobe(nprobe);
+            let mut search_time = Duration::default();
+            let mut score_time = Duration::default();
+            let mut found = 0;
+            for &i in queries.iter() {
+                let start = Instant::now();
+                let neighbors = index
+                    .search(&descriptors[i], opts.knn_k, &mut buffer)
+                    .iter()
+                    .collect::<Vec<Neighbor>>();
+                search_time += start.elapsed();
+
+                let start = Instant::now();
+                let result = db.score(neighbors, opts.distance, opts.output_count)?;
+                score_time += start.elapsed();
+                if result.first().map(|(_, path)| path) == Some(&paths[i]) {
+                    found += 1;
+                }
+            }
+            println!(
+                "nprobe {:<4}  search {:8.3} ms/query, score {:8.3} ms/query, top-1 {:5.1}%",
+                nprobe,
+                per_item(search_time, queries.len()),
+                per_item(score_time, queries.len()),
+                found as f64 * 100.0 / queries.len().max(1) as f64
+            );
+        }
+        Ok(())
+    }
+}
@@ -1,11 +1,15 @@
 use crate::cmd::SubCommandExtend;
 use crate::config::{Opts, OutputFormat};
+use crate::manifest::{FileStamp, Manifest};
 use crate::slam3_orb::Slam3ORB;
+use crate::utils;
 use crate::IMDB;
-use crate::ORB;
 use anyhow::Result;
-use rayon::prelude::*;
+use log::info;
 use regex::Regex;
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Mutex;
 use structopt::StructOpt;
 use walkdir::WalkDir;
 
@@ -16,6 +20,21 @@ pub struct AddImages {
     /// Scan image with these suffixes
     #[structopt(short, long, default_value = "jpg,png")]
     pub suffix: String,
+    /// Number of images to extract features from in one batch
+    #[structopt(long, value_name = "N", default_value = "256")]
+    pub chunk_size: usize,
+    /// Ingest new images as SST files instead of normal writes, faster for initial loads
+    #[structopt(long)]
+    pub ingest: bool,
+    /// Threads used to read and hash image files
+    #[structopt(long, value_name = "N", default_value = "8")]
+    pub read_threads: usize,
+    /// Threads used to decode images, 0 means the number of CPUs
+    #[structopt(long, value_name = "N", default_value = "0")]
+    pub decode_threads: usize,
+    /// Skip files whose path, size and modification time are unchanged since they were added
+    #[structopt(long)]
+    pub rescan: bool,
 }
 
 #[derive(StructOpt, Debug, Clone)]
@@ -28,31 +47,69 @@ impl SubCommandExtend for AddImages {
     fn run(&self, opts: &Opts) -> anyhow::Result<()> {
         let re = Regex::new(&self.suffix.replace(',', "|")).expect("failed to build regex");
         let db = IMDB::new(opts.conf_dir.clone(), false)?;
-        WalkDir::new(&self.path)
+        let mut orb = Slam3ORB::from(opts);
+        let manifest_path = opts.conf_dir.manifest();
+        let manifest = Mutex::new(Manifest::load(&manifest_path)?);
+        let pending = Mutex::new(HashMap::new());
+        let skipped = AtomicUsize::new(0);
+        let entries = WalkDir::new(&self.path)
             .into_iter()
             .filter_map(|entry| entry.ok())
-            .par_bridge()
-            .for_each(|entry| {
-                let entry = entry.into_path();
-                if entry
+            .filter(|entry| {
+                entry
+                    .path()
                     .extension()
                     .map(|s| re.is_match(&*s.to_string_lossy()))
-                    != Some(true)
-                {
-                    return;
+                    == Some(true)
+            })
+            .filter_map(|entry| {
+                let path = entry.path().to_string_lossy().into_owned();
+                let stamp = match entry.metadata() {
+                    Ok(metadata) => FileStamp::new(&metadata),
+                    Err(_) => return Some(path),
+                };
+                if self.rescan && manifest.lock().unwrap().contains(&path, stamp) {
+                    skipped.fetch_add(1, Ordering::Relaxed);
+                    return None;
                 }
+                pending.lock().unwrap().insert(path.clone(), stamp);
+                Some(path)
+            });
 
-                let result =
-                    ORB.with(|orb| db.add_image(entry.to_string_lossy(), &mut *orb.borrow_mut()));
+        let decode_threads = match self.decode_threads {
+            0 => rayon::current_num_threads(),
+            n => n,
+        };
+        let result = db.add_images_pipelined(
+            entries,
+            &mut orb,
+            self.chunk_size,
+            self.read_threads,
+            decode_threads,
+            self.ingest,
+            |entry, result| {
+                let stamp = pending.lock().unwrap().remove(entry);
                 match result {
-                    Ok(add) => match add {
-                        true => println!("[OK] Add {}", entry.display()),
-                        false => println!("[OK] Update {}", entry.display()),
-                    },
-                    Err(e) => eprintln!("[ERR] {}: {}\n{}", entry.display(), e, e.backtrace()),
+                    Ok(add) => {
+                        if let Some(stamp) = stamp {
+                            manifest.lock().unwrap().insert(entry.to_owned(), stamp);
+                        }
+                        match add {
+                            true => println!("[OK] Add {}", entry),
+                            false => println!("[OK] Update {}", entry),
+                        }
+                    }
+                    Err(e) => eprintln!("[ERR] {}: {}\n{}", entry, e, e.backtrace()),
                 }
-            });
-        Ok(())
+            },
+        );
+
+        // save what was added even if the scan stopped early, so it isn't read again next time
+        manifest.into_inner().unwrap().save(&manifest_path)?;
+        if self.rescan {
+            info!("skipped {} unchanged files", skipped.into_inner());
+        }
+        result
     }
 }
 
@@ -63,10 +120,27 @@ impl SubCommandExtend for SearchImage {
 
         let mut index = db.get_multi_index(opts.mmap);
         index.set_nprobe(opts.nprobe);
+        if opts.ef_search != 0 {
+            index.set_ef_search(opts.ef_search);
+        }
+        index.set_shard_threads(opts.shard_threads);
 
-        let mut result = db.search(&index, &self.image, &mut orb, 3, opts.distance)?;
+        let result = match opts.range_search {
+            true => {
+                let image = utils::imread(&self.image)?;
+                let (_, descriptors) = utils::detect_and_compute(&mut orb, &image)?;
+                db.range_search_des(&index, descriptors, opts.distance, opts.output_count)?
+            }
+            false => db.search(
+                &index,
+                &self.image,
+                &mut orb,
+                3,
+                opts.distance,
+                opts.output_count,
+            )?,
+        };
 
-        result.truncate(opts.output_count);
         print_result(&result, opts)
     }
 }
@@ -1,7 +1,7 @@
 use crate::cmd::SubCommandExtend;
 use crate::{Opts, IMDB};
 use anyhow::Result;
-use ndarray_npy::write_npy;
+use log::info;
 use structopt::StructOpt;
 
 #[derive(StructOpt, Debug, Clone)]
@@ -26,10 +26,53 @@ pub struct BuildIndex {
     /// Skip index >= end
     #[structopt(long)]
     pub end: Option<u64>,
+    /// Add the features of this run to a new index segment instead of rewriting the whole index
+    #[structopt(long)]
+    pub segment: bool,
+}
+
+#[derive(StructOpt, Debug, Clone)]
+pub struct MergeIndex {
+    /// Write the merged inverted lists to an .ivfdata file, merging with mmap and little memory
+    #[structopt(long)]
+    pub on_disk: bool,
 }
 
 #[derive(StructOpt, Debug, Clone)]
-pub struct ExportData {}
+pub struct TrainIndex {
+    /// Index to train, such as BIVF1048576_HNSW32, defaults to one chosen by the number of features
+    #[structopt(long, value_name = "DESCRIPTION")]
+    pub description: Option<String>,
+    /// Number of features sampled for training, defaults to 256 per bucket, at most 10M
+    /// features, but at least 39 per bucket
+    #[structopt(long, value_name = "N")]
+    pub samples: Option<usize>,
+    /// Run k-means on this faiss index_factory description, such as HNSW32, instead of a flat index
+    #[structopt(long, value_name = "DESCRIPTION")]
+    pub clustering_index: Option<String>,
+    /// Seed of the sampling
+    #[structopt(long, default_value = "0")]
+    pub seed: u64,
+}
+
+#[derive(StructOpt, Debug, Clone)]
+pub struct ExportData {
+    /// Output file
+    #[structopt(long, default_value = "train.npy")]
+    pub output: String,
+    /// Skip features with id < start
+    #[structopt(long)]
+    pub start: Option<u64>,
+    /// Skip features with id >= end
+    #[structopt(long)]
+    pub end: Option<u64>,
+    /// Export each feature with this probability
+    #[structopt(long, default_value = "1.0")]
+    pub sample_rate: f64,
+    /// Seed of the sampling
+    #[structopt(long, default_value = "0")]
+    pub seed: u64,
+}
 
 impl SubCommandExtend for MarkAsIndexed {
     fn run(&self, opts: &Opts) -> Result<()> {
@@ -48,15 +91,40 @@ impl SubCommandExtend for ClearCache {
 impl SubCommandExtend for BuildIndex {
     fn run(&self, opts: &Opts) -> Result<()> {
         let db = IMDB::new(opts.conf_dir.clone(), false)?;
-        db.build_index(opts.batch_size, self.start, self.end)
+        db.build_index(opts.batch_size, self.start, self.end, self.segment)
+    }
+}
+
+impl SubCommandExtend for MergeIndex {
+    fn run(&self, opts: &Opts) -> Result<()> {
+        let db = IMDB::new(opts.conf_dir.clone(), true)?;
+        db.merge_index(self.on_disk)
+    }
+}
+
+impl SubCommandExtend for TrainIndex {
+    fn run(&self, opts: &Opts) -> Result<()> {
+        let db = IMDB::new(opts.conf_dir.clone(), true)?;
+        db.train_index(
+            self.description.as_deref(),
+            self.samples,
+            self.clustering_index.as_deref(),
+            self.seed,
+        )
     }
 }
 
 impl SubCommandExtend for ExportData {
     fn run(&self, opts: &Opts) -> Result<()> {
         let db = IMDB::new(opts.conf_dir.clone(), true)?;
-        let data = db.export()?;
-        write_npy("train.npy", &data)?;
+        let rows = db.export(
+            &self.output,
+            self.start,
+            self.end,
+            self.sample_rate,
+            self.seed,
+        )?;
+        info!("exported {} features to {}", rows, self.output);
         Ok(())
     }
 }
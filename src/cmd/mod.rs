@@ -1,3 +1,4 @@
+mod bench;
 mod image;
 mod index;
 mod server;
@@ -5,6 +6,7 @@ mod show;
 
 use crate::config::Opts;
 use anyhow::Result;
+pub use bench::*;
 pub use image::*;
 pub use index::*;
 pub use server::*;
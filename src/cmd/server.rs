@@ -1,13 +1,24 @@
+use crate::batcher::SearchBatcher;
+use crate::cache::LruCache;
 use crate::cmd::SubCommandExtend;
+use crate::imdb::AdaptiveStage;
+use crate::index::{MultiFaissIndex, ReloadPlan};
+use crate::matrix::{Matrix, Matrix2D};
+use crate::metrics::{self, METRICS};
+use crate::remote::{self, RemoteShard};
 use crate::utils;
-use crate::{Opts, IMDB, Slam3ORB};
-use log::info;
+use crate::{Opts, Slam3ORB, IMDB};
+use log::{info, warn};
 use opencv::imgcodecs;
 use opencv::prelude::*;
+use rayon::ThreadPool;
 use rouille::{post_input, router, try_or_400, Response};
 use serde_json::json;
-use std::sync::RwLock;
-use std::time::Instant;
+use std::collections::HashMap;
+use std::net::TcpListener;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex, RwLock};
+use std::time::{Duration, Instant};
 use structopt::StructOpt;
 
 #[derive(StructOpt, Debug, Clone)]
@@ -15,52 +26,489 @@ pub struct StartServer {
     /// Listen address
     #[structopt(long, default_value = "127.0.0.1:8000")]
     pub addr: String,
+    /// Maximum number of requests being handled, more requests are rejected with 503
+    #[structopt(long, value_name = "N", default_value = "64")]
+    pub max_pending: usize,
+    /// Threads used to decode images and extract features, 0 means the number of CPUs
+    #[structopt(long, value_name = "N", default_value = "0")]
+    pub extract_threads: usize,
+    /// Threads used to search the index, 0 means the number of CPUs
+    #[structopt(long, value_name = "N", default_value = "0")]
+    pub search_threads: usize,
+    /// Search queries arrived within this many milliseconds together, 0 disables batching
+    #[structopt(long, value_name = "MS", default_value = "0")]
+    pub batch_window: u64,
+    /// Maximum number of queries in a batch
+    #[structopt(long, value_name = "N", default_value = "32")]
+    pub batch_queries: usize,
+    /// Prefetch this many MiB of the most probed inverted lists at startup, useful with --mmap
+    #[structopt(long, value_name = "MIB", default_value = "0")]
+    pub warmup: usize,
+    /// Record the inverted lists probed by one in N queries for --warmup, 0 disables it.
+    /// The coarse quantizer runs a second time for these queries
+    #[structopt(long, value_name = "N", default_value = "0")]
+    pub probe_sample: usize,
+    /// Check for new, rebuilt or removed index files every N seconds, 0 only reloads on /reload
+    #[structopt(long, value_name = "SECS", default_value = "0")]
+    pub reload_interval: u64,
+    /// Cache the results of this many queries, keyed by image and search parameters, 0 disables it
+    #[structopt(long, value_name = "N", default_value = "0")]
+    pub result_cache: usize,
+    /// Cache the descriptors of this many images, so they are not extracted again when a query
+    /// is repeated with other parameters, 0 disables it
+    #[structopt(long, value_name = "N", default_value = "0")]
+    pub descriptor_cache: usize,
+    /// Also answer descriptor searches of a coordinator on this address, such as 0.0.0.0:8001
+    #[structopt(long, value_name = "ADDR")]
+    pub backend_addr: Option<String>,
+    /// Search nodes started with --backend-addr, searched together with the local index files
+    #[structopt(long, value_name = "ADDR")]
+    pub remote: Vec<String>,
+    /// Timeout of a search node in milliseconds
+    #[structopt(long, value_name = "MS", default_value = "10000")]
+    pub remote_timeout: u64,
+    /// Search in stages of NPROBE:FEATURES, such as 8:200,32:500,128:500, each searching the
+    /// strongest FEATURES descriptors, and only move to the next stage when the best image is
+    /// unclear. Overrides nprobe and batching of k-NN searches
+    #[structopt(long, value_name = "STAGES", use_delimiter = true)]
+    pub adaptive: Vec<AdaptiveStage>,
+    /// An adaptive stage is accepted when the best score leads the second by this much
+    #[structopt(long, value_name = "SCORE", default_value = "10")]
+    pub adaptive_margin: f32,
+}
+
+/// How often the probe statistics are saved
+const SAVE_HITS_INTERVAL: Duration = Duration::from_secs(60);
+
+/// Prebuilt extractors, keyed by scale factor
+struct ExtractorPool {
+    opts: Opts,
+    pool: Mutex<HashMap<u32, Vec<Slam3ORB>>>,
+}
+
+impl ExtractorPool {
+    /// Only keep extractors of a few scale factors, others are built for every request
+    const MAX_SCALE_FACTORS: usize = 8;
+
+    fn new(opts: Opts) -> Self {
+        Self {
+            opts,
+            pool: Mutex::new(HashMap::new()),
+        }
+    }
+
+    fn get(&self, scale_factor: f32) -> Slam3ORB {
+        let orb = self
+            .pool
+            .lock()
+            .unwrap()
+            .get_mut(&scale_factor.to_bits())
+            .and_then(|orbs| orbs.pop());
+        orb.unwrap_or_else(|| {
+            let mut opts = self.opts.clone();
+            opts.orb_scale_factor = scale_factor;
+            let mut orb = Slam3ORB::from(&opts);
+            orb.set_time_stages(true);
+            orb
+        })
+    }
+
+    fn put(&self, scale_factor: f32, orb: Slam3ORB) {
+        let mut pool = self.pool.lock().unwrap();
+        let key = scale_factor.to_bits();
+        if pool.contains_key(&key) || pool.len() < Self::MAX_SCALE_FACTORS {
+            pool.entry(key).or_insert_with(Vec::new).push(orb);
+        }
+    }
+}
+
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+struct ResultKey {
+    image: blake3::Hash,
+    scale_factor: u32,
+    nprobe: Option<usize>,
+    ef_search: Option<usize>,
+    knn: usize,
+    distance: u32,
+    generation: u64,
+}
+
+/// Results and descriptors of recent queries, keyed by the blake3 hash of the uploaded image
+struct QueryCache {
+    results: LruCache<ResultKey, Arc<Vec<(f32, String)>>>,
+    /// Keyed by image and scale factor
+    descriptors: LruCache<(blake3::Hash, u32), Arc<Matrix2D>>,
+    /// Bumped whenever the index changes, results of older generations are never returned
+    generation: AtomicU64,
+}
+
+impl QueryCache {
+    fn new(results: usize, descriptors: usize) -> Self {
+        Self {
+            results: LruCache::new(results),
+            descriptors: LruCache::new(descriptors),
+            generation: AtomicU64::new(0),
+        }
+    }
+
+    /// Read before searching, so a result is never stored under a newer generation than the
+    /// index it was searched in
+    fn generation(&self) -> u64 {
+        self.generation.load(Ordering::SeqCst)
+    }
+
+    /// Drop all results, must be called while holding the index write lock
+    fn invalidate(&self) {
+        self.generation.fetch_add(1, Ordering::SeqCst);
+        self.results.clear();
+    }
+}
+
+/// Count a request as pending until dropped
+struct PendingGuard<'a>(&'a AtomicUsize);
+
+impl<'a> PendingGuard<'a> {
+    fn try_new(pending: &'a AtomicUsize, max: usize) -> Option<Self> {
+        if pending.fetch_add(1, Ordering::SeqCst) >= max {
+            pending.fetch_sub(1, Ordering::SeqCst);
+            return None;
+        }
+        Some(Self(pending))
+    }
+}
+
+impl Drop for PendingGuard<'_> {
+    fn drop(&mut self) {
+        self.0.fetch_sub(1, Ordering::SeqCst);
+    }
+}
+
+/// Swap in new index shards and a new view of the database, while searches keep running
+struct Reloader {
+    opts: Opts,
+    db: RwLock<Arc<IMDB>>,
+    index: Arc<RwLock<MultiFaissIndex>>,
+    cache: Arc<QueryCache>,
+    lock: Mutex<()>,
+}
+
+impl Reloader {
+    /// The database matching the current shards, take it after locking the index
+    fn db(&self) -> Arc<IMDB> {
+        self.db.read().expect("failed to acquire rw lock").clone()
+    }
+
+    /// Return the loaded and retired index files
+    ///
+    /// Shards are read without holding a lock on the index, the write lock is only taken to
+    /// swap them in
+    fn reload(&self) -> anyhow::Result<ReloadPlan> {
+        let _guard = self.lock.lock().unwrap();
+        let plan = self
+            .index
+            .read()
+            .expect("failed to acquire rw lock")
+            .plan_reload(self.db().index_files());
+        if plan.is_empty() {
+            return Ok(plan);
+        }
+        let summary = plan.clone();
+
+        // new shards can reference images added after the database was opened
+        let db = IMDB::new(self.opts.conf_dir.clone(), true)?;
+        db.image_id_table()?;
+        let update = plan.load(self.opts.mmap);
+
+        let old = {
+            let mut index = self.index.write().expect("failed to acquire rw lock");
+            *self.db.write().expect("failed to acquire rw lock") = Arc::new(db);
+            self.cache.invalidate();
+            index.apply(update)
+        };
+        info!(
+            "reloaded index: {} loaded, {} retired",
+            summary.load.len(),
+            summary.retire.len()
+        );
+        // large shards take a while to free, which is done after releasing the lock
+        drop(old);
+        Ok(summary)
+    }
+}
+
+/// Search descriptors in the local shards, and in the search nodes of a coordinator
+struct Searcher {
+    opts: Opts,
+    index: Arc<RwLock<MultiFaissIndex>>,
+    reloader: Arc<Reloader>,
+    pool: Arc<ThreadPool>,
+    batcher: Option<SearchBatcher>,
+    remotes: Vec<RemoteShard>,
+    adaptive: Vec<AdaptiveStage>,
+    adaptive_margin: f32,
+}
+
+impl Searcher {
+    /// Search the local shards, and return at most `limit` images
+    fn search_local<M: Matrix>(
+        &self,
+        descriptors: &M,
+        limit: usize,
+    ) -> anyhow::Result<Vec<(f32, String)>> {
+        let opts = &self.opts;
+        match &self.batcher {
+            _ if opts.range_search => self.pool.install(|| {
+                let index = self.index.read().expect("failed to acquire rw lock");
+                self.reloader
+                    .db()
+                    .range_search_des(&*index, descriptors, opts.distance, limit)
+            }),
+            _ if !self.adaptive.is_empty() => self.pool.install(|| {
+                let index = self.index.read().expect("failed to acquire rw lock");
+                self.reloader.db().adaptive_search_des(
+                    &*index,
+                    descriptors,
+                    &self.adaptive,
+                    self.adaptive_margin,
+                    opts.knn_k,
+                    opts.distance,
+                    limit,
+                )
+            }),
+            Some(batcher) => batcher
+                .search(descriptors)
+                .and_then(|neighbors| self.reloader.db().score(neighbors, opts.distance, limit)),
+            None => self.pool.install(|| {
+                let index = self.index.read().expect("failed to acquire rw lock");
+                self.reloader.db().search_des(
+                    &*index,
+                    descriptors,
+                    opts.knn_k,
+                    opts.distance,
+                    limit,
+                )
+            }),
+        }
+    }
+
+    /// Search the local shards and all search nodes at the same time, and merge the results
+    ///
+    /// Every node scores its own images, so the results are merged by score
+    fn search<M: Matrix + Sync>(&self, descriptors: &M) -> anyhow::Result<Vec<(f32, String)>> {
+        let limit = self.opts.output_count;
+        if self.remotes.is_empty() {
+            return self.search_local(descriptors, limit);
+        }
+        let has_local = !self
+            .index
+            .read()
+            .expect("failed to acquire rw lock")
+            .shards()
+            .is_empty();
+
+        crossbeam_utils::thread::scope(|s| {
+            let remote = s.spawn(|_| remote::search_all(&self.remotes, descriptors, limit));
+            let mut result = match has_local {
+                true => self.search_local(descriptors, limit)?,
+                false => vec![],
+            };
+            result.extend(remote.join().expect("remote search panicked")?);
+            remote::merge_results(&mut result, limit);
+            Ok(result)
+        })
+        .expect("remote search panicked")
+    }
 }
 
 impl SubCommandExtend for StartServer {
     fn run(&self, opts: &Opts) -> anyhow::Result<()> {
         let db = IMDB::new(opts.conf_dir.clone(), true)?;
+        // map the image id table before the first request
+        db.image_id_table()?;
 
         let mut index = db.get_multi_index(opts.mmap);
         index.set_nprobe(opts.nprobe);
+        if opts.ef_search != 0 {
+            index.set_ef_search(opts.ef_search);
+        }
+        index.set_shard_threads(opts.shard_threads);
+        index.load_list_hits(opts.conf_dir.list_hits());
+        if self.warmup != 0 {
+            index.warmup(self.warmup << 20);
+        }
 
-        let index = RwLock::new(index);
+        let index = Arc::new(RwLock::new(index));
+        let cache = Arc::new(QueryCache::new(self.result_cache, self.descriptor_cache));
+        let reloader = Arc::new(Reloader {
+            opts: opts.clone(),
+            db: RwLock::new(Arc::new(db)),
+            index: index.clone(),
+            cache: cache.clone(),
+            lock: Mutex::new(()),
+        });
+        if self.reload_interval != 0 {
+            let reloader = reloader.clone();
+            let interval = Duration::from_secs(self.reload_interval);
+            std::thread::spawn(move || loop {
+                std::thread::sleep(interval);
+                if let Err(e) = reloader.reload() {
+                    warn!("failed to reload index: {}", e);
+                }
+            });
+        }
+        if self.probe_sample != 0 {
+            let index = index.clone();
+            let dir = opts.conf_dir.list_hits();
+            std::thread::spawn(move || loop {
+                std::thread::sleep(SAVE_HITS_INTERVAL);
+                // the lock is released before writing, so reloads don't wait for the disk
+                let hits = index.read().expect("failed to acquire rw lock").list_hits();
+                if let Err(e) = MultiFaissIndex::save_list_hits(&dir, &hits) {
+                    warn!("failed to save list hits: {}", e);
+                }
+            });
+        }
+        let queries = AtomicUsize::new(0);
+        let probe_sample = self.probe_sample;
         let opts = opts.clone();
+        let extractors = ExtractorPool::new(opts.clone());
+        let extract_pool = rayon::ThreadPoolBuilder::new()
+            .num_threads(self.extract_threads)
+            .thread_name(|i| format!("extract-{}", i))
+            .build()?;
+        let search_pool = Arc::new(
+            rayon::ThreadPoolBuilder::new()
+                .num_threads(self.search_threads)
+                .thread_name(|i| format!("search-{}", i))
+                .build()?,
+        );
+        let batcher = match self.batch_window {
+            0 => None,
+            window => Some(SearchBatcher::new(
+                index.clone(),
+                search_pool.clone(),
+                opts.knn_k,
+                Duration::from_millis(window),
+                self.batch_queries,
+            )),
+        };
+        let remotes = self
+            .remote
+            .iter()
+            .map(|addr| RemoteShard::new(addr.clone(), Duration::from_millis(self.remote_timeout)))
+            .collect();
+        let searcher = Arc::new(Searcher {
+            opts: opts.clone(),
+            index: index.clone(),
+            reloader: reloader.clone(),
+            pool: search_pool,
+            batcher,
+            remotes,
+            adaptive: self.adaptive.clone(),
+            adaptive_margin: self.adaptive_margin,
+        });
+        if let Some(addr) = &self.backend_addr {
+            let listener = TcpListener::bind(addr)?;
+            let searcher = searcher.clone();
+            info!("answering searches of a coordinator at {}", addr);
+            std::thread::spawn(move || {
+                remote::serve(listener, move |descriptors, limit| {
+                    if descriptors.width() != 32 {
+                        anyhow::bail!("descriptors must be 32 bytes wide");
+                    }
+                    // nodes never search other nodes, so coordinators can't loop
+                    searcher.search_local(&descriptors, limit)
+                })
+            });
+        }
+        let pending = AtomicUsize::new(0);
+        let max_pending = self.max_pending;
+        let sort_descriptors = !self.adaptive.is_empty();
 
         info!("starting server at http://{}", &self.addr);
-        rouille::start_server(&self.addr, move |request| {
-            let opts = opts.clone();
+        let server = rouille::Server::new(&self.addr, move |request| {
             router!(request,
                 (POST) (/search) => {
+                    let _guard = match PendingGuard::try_new(&pending, max_pending) {
+                        Some(guard) => guard,
+                        None => return Response::text("too many requests").with_status_code(503),
+                    };
+
                     let data = try_or_400!(post_input!(request, {
                         file: rouille::input::post::BufferedFile,
                         orb_scale_factor: Option<f32>,
                     }));
-                    let mat = try_or_400!(Mat::from_slice(&data.file.data));
-                    let img = try_or_400!(imgcodecs::imdecode(&mat, imgcodecs::IMREAD_GRAYSCALE));
+                    let scale_factor = data.orb_scale_factor.unwrap_or(opts.orb_scale_factor);
 
                     info!("searching {:?}", data.file.filename);
 
-                    let mut opts = opts.clone();
-                    if let Some(orb_scale_factor) = data.orb_scale_factor {
-                        opts.orb_scale_factor = orb_scale_factor;
+                    let start = Instant::now();
+                    let image = blake3::hash(&data.file.data);
+                    let result_key = {
+                        let index = index.read().expect("failed to acquire rw lock");
+                        ResultKey {
+                            image,
+                            scale_factor: scale_factor.to_bits(),
+                            nprobe: index.nprobe(),
+                            ef_search: index.ef_search(),
+                            knn: opts.knn_k,
+                            distance: opts.distance,
+                            generation: cache.generation(),
+                        }
+                    };
+                    if let Some(result) = cache.results.get(&result_key) {
+                        return Response::json(&json!({
+                            "time": start.elapsed().as_secs_f32(),
+                            "result": &*result,
+                            "cached": true,
+                        }));
                     }
-                    let mut orb = Slam3ORB::from(&opts);
 
-                    let start = Instant::now();
-                    let result = utils::detect_and_compute(&mut orb, &img)
-                            .and_then(|(_, descriptors)| {
-                            let index = index.read().expect("failed to acquire rw lock");
-                            db.search_des(&*index, descriptors, opts.knn_k, opts.distance)
-                        });
+                    let descriptor_key = (image, scale_factor.to_bits());
+                    let descriptors = match cache.descriptors.get(&descriptor_key) {
+                        Some(descriptors) => Ok(descriptors),
+                        None => extract_pool
+                            .install(|| -> anyhow::Result<Arc<Matrix2D>> {
+                                let start = Instant::now();
+                                let mat = Mat::from_slice(&data.file.data)?;
+                                let img = imgcodecs::imdecode(&mat, imgcodecs::IMREAD_GRAYSCALE)?;
+                                METRICS.decode.observe_since(start);
+                                let start = Instant::now();
+                                let mut orb = extractors.get(scale_factor);
+                                let result = utils::detect_and_compute(&mut orb, &img);
+                                METRICS.extract.observe_since(start);
+                                METRICS.observe_stages(&orb.take_stage_times());
+                                extractors.put(scale_factor, orb);
+                                let (keypoints, descriptors) = result?;
+                                // adaptive stages search the strongest descriptors first
+                                Ok(Arc::new(match sort_descriptors {
+                                    true => utils::sort_by_response(&keypoints, &descriptors),
+                                    false => Matrix2D::from_matrix(&descriptors),
+                                }))
+                            })
+                            .map(|descriptors| {
+                                cache.descriptors.insert(descriptor_key, descriptors.clone());
+                                descriptors
+                            }),
+                    };
+                    let result = descriptors
+                        .map(|descriptors| {
+                            if probe_sample != 0 && queries.fetch_add(1, Ordering::Relaxed) % probe_sample == 0 {
+                                index.read().expect("failed to acquire rw lock").record_probes(&*descriptors);
+                            }
+                            descriptors
+                        })
+                        .and_then(|descriptors| searcher.search(&*descriptors));
                     let elapsed = start.elapsed().as_secs_f32();
 
                     match result {
-                        Ok(mut result) => {
-                            result.truncate(opts.output_count);
+                        Ok(result) => {
+                            let result = Arc::new(result);
+                            cache.results.insert(result_key, result.clone());
                             Response::json(&json!({
                                 "time": elapsed,
-                                "result": result,
+                                "result": &*result,
+                                "cached": false,
                             }))
                         },
                         Err(err) => {
@@ -73,18 +521,75 @@ impl SubCommandExtend for StartServer {
                     let data = try_or_400!(post_input!(request, {
                         n: usize,
                     }));
-                    try_or_400!(index.write()).set_nprobe(data.n);
+                    let mut index = try_or_400!(index.write());
+                    index.set_nprobe(data.n);
+                    cache.invalidate();
                     Response::text("").with_status_code(200)
                 },
+                (POST) (/set_ef_search) => {
+                    let data = try_or_400!(post_input!(request, {
+                        n: usize,
+                    }));
+                    let mut index = try_or_400!(index.write());
+                    index.set_ef_search(data.n);
+                    cache.invalidate();
+                    Response::text("").with_status_code(200)
+                },
+                (POST) (/reload) => {
+                    match reloader.reload() {
+                        Ok(plan) => Response::json(&json!({
+                            "loaded": plan.load,
+                            "retired": plan.retire,
+                        })),
+                        Err(err) => Response::json(&err.to_string()).with_status_code(500),
+                    }
+                },
+                (POST) (/warmup) => {
+                    let data = try_or_400!(post_input!(request, {
+                        mib: Option<usize>,
+                    }));
+                    let max_bytes = data.mib.map_or(usize::MAX, |mib| mib << 20);
+                    let start = Instant::now();
+                    let bytes = try_or_400!(index.read()).warmup(max_bytes);
+                    Response::json(&json!({
+                        "time": start.elapsed().as_secs_f32(),
+                        "bytes": bytes,
+                    }))
+                },
+                (GET) (/metrics) => {
+                    let mut out = String::new();
+                    METRICS.render(&mut out);
+
+                    let name = "imsearch_shard_search_seconds";
+                    metrics::render_header(&mut out, name, "histogram", "Search of each index shard");
+                    for shard in try_or_400!(index.read()).shards() {
+                        let label = format!("shard=\"{}\"", shard.path().display());
+                        shard.search_time.render(&mut out, name, &label);
+                    }
+
+                    let caches = [("result", cache.results.stats()), ("descriptor", cache.descriptors.stats())];
+                    for &(name, (hits, misses)) in caches.iter() {
+                        metrics::render_counter(&mut out, &format!("imsearch_{}_cache_hits_total", name), "Cache hits", hits);
+                        metrics::render_counter(&mut out, &format!("imsearch_{}_cache_misses_total", name), "Cache misses", misses);
+                    }
+                    Response::text(out)
+                },
                 _ => {
                     Response::html(r#"
                 <p>
                 http --form http://127.0.0.1/search file@test.jpg orb_scale_factor=1.2</br>
-                http --form http://127.0.0.1/set_nprobe n=128
+                http --form http://127.0.0.1/set_nprobe n=128</br>
+                http --form http://127.0.0.1/set_ef_search n=256</br>
+                http --form http://127.0.0.1/warmup mib=1024</br>
+                http --form http://127.0.0.1/reload</br>
+                http http://127.0.0.1/metrics
                 </p>
                 "#).with_status_code(404)
                 }
             )
-        });
+        })
+        .map_err(|e| anyhow::anyhow!("failed to start server: {}", e))?;
+        server.pool_size(max_pending + 8).run();
+        Ok(())
     }
 }
@@ -47,6 +47,15 @@ pub struct Opts {
     /// Record orientation info
     #[structopt(long)]
     pub orb_not_oriented: bool,
+    /// Reuse pyramid and scratch buffers between images
+    #[structopt(long)]
+    pub orb_reuse_buffers: bool,
+    /// Use several threads to extract features of a single image
+    #[structopt(long)]
+    pub orb_parallel: bool,
+    /// Only blur the parts of the image around keypoints
+    #[structopt(long)]
+    pub orb_blur_tiles: bool,
 
     /// Use mmap instead of read whole index to memory
     #[structopt(long)]
@@ -71,9 +80,20 @@ pub struct Opts {
     /// Count of best matches found per each query descriptor
     #[structopt(long, value_name = "K", default_value = "3")]
     pub knn_k: usize,
+    /// Match all features within --distance instead of the nearest --knn-k ones
+    #[structopt(long)]
+    pub range_search: bool,
     /// How many bucket to search
     #[structopt(long, value_name = "N", default_value = "3")]
     pub nprobe: usize,
+    /// efSearch of HNSW quantizers, larger values find closer buckets but take more time,
+    /// 0 keeps the value saved in the index
+    #[structopt(long, value_name = "N", default_value = "0")]
+    pub ef_search: usize,
+    /// Threads used by each index shard during search, 0 means the OpenMP default. Shards are
+    /// searched at once, so this is lowered until shards * N is at most the number of CPUs
+    #[structopt(long, value_name = "N", default_value = "0")]
+    pub shard_threads: usize,
 
     #[structopt(subcommand)]
     pub subcmd: SubCommand,
@@ -91,14 +111,20 @@ pub enum SubCommand {
     SearchImage(SearchImage),
     /// Start Web server
     StartServer(StartServer),
+    /// Train index on a sample of features
+    TrainIndex(TrainIndex),
     /// Build index
     BuildIndex(BuildIndex),
+    /// Merge the index and its segments into one index file
+    MergeIndex(MergeIndex),
     /// Clear indexed (and unindexed) features
     ClearCache(ClearCache),
     /// Mark a range of features as trained
     MarkAsIndexed(MarkAsIndexed),
     /// Export data for trainning
     ExportData(ExportData),
+    /// Measure extraction, ingestion, index building and search on a synthetic database
+    Benchmark(Benchmark),
 }
 
 #[derive(StructOpt, Debug, Clone)]
@@ -139,7 +165,7 @@ impl FromStr for OutputFormat {
 
 impl From<&Opts> for Slam3ORB {
     fn from(opts: &Opts) -> Self {
-        Self::create(
+        let mut orb = Self::create(
             opts.orb_nfeatures as i32,
             opts.orb_scale_factor,
             opts.orb_nlevels as i32,
@@ -148,7 +174,11 @@ impl From<&Opts> for Slam3ORB {
             opts.orb_interpolation,
             !opts.orb_not_oriented,
         )
-        .expect("failed to build Slam3Orb")
+        .expect("failed to build Slam3Orb");
+        orb.set_reuse_buffers(opts.orb_reuse_buffers);
+        orb.set_parallel(opts.orb_parallel);
+        orb.set_blur_tiles(opts.orb_blur_tiles);
+        orb
     }
 }
 
@@ -181,6 +211,35 @@ impl ConfDir {
         self.0.join("index")
     }
 
+    /// Index segment written by an incremental build, searched together with the main index
+    pub fn segment(&self, n: u32) -> PathBuf {
+        self.0.join(format!("index-{:05}", n))
+    }
+
+    /// Columnar feature store, only exists in databases created since version 4
+    pub fn features(&self) -> PathBuf {
+        self.0.join("features")
+    }
+
+    /// On-disk inverted lists written by merge-index
+    pub fn ivfdata(&self, n: u64) -> PathBuf {
+        self.0.join(format!("index.{}.ivfdata", n))
+    }
+
+    /// Probe statistics of inverted lists, one file per index shard
+    pub fn list_hits(&self) -> PathBuf {
+        self.0.join("list_hits")
+    }
+
+    /// Files scanned by add-images, see `Manifest`
+    pub fn manifest(&self) -> PathBuf {
+        self.0.join("manifest")
+    }
+
+    pub fn image_id_table(&self) -> PathBuf {
+        self.0.join("image_id_table")
+    }
+
     pub fn version(&self) -> PathBuf {
         self.0.join("version")
     }
@@ -1,15 +1,25 @@
+use std::collections::HashSet;
+use std::path::Path;
 use std::sync::atomic::{AtomicU64, Ordering};
-use std::sync::Arc;
+use std::sync::{Arc, Mutex};
 
 use crate::config::ConfDir;
+use crate::db::feature_store::{FeatureStore, IdRanges};
 use crate::db::utils::{bytes_to_i32, bytes_to_u64, default_options};
+use crate::db::ImageIdTable;
 use crate::matrix::Matrix;
-use anyhow::Result;
+use anyhow::{bail, Result};
 use log::{debug, info};
 use rocksdb::{
-    BoundColumnFamily, ColumnFamilyDescriptor, IteratorMode, ReadOptions, WriteBatch, DB,
+    BoundColumnFamily, ColumnFamilyDescriptor, IngestExternalFileOptions, IteratorMode,
+    ReadOptions, SstFileWriter, WriteBatch, DB,
 };
 
+/// Records buffered by `ingest_images` before they are ingested, see `IngestBuffer`
+const INGEST_BUFFER_BYTES: usize = 256 << 20;
+/// Size of the SST files written from the buffer
+const INGEST_SST_BYTES: usize = 64 << 20;
+
 #[derive(Debug, Hash, Eq, PartialEq)]
 pub(super) enum ImageColumnFamily {
     /// HashMap<FeatureId, Box<[u8]>>
@@ -29,6 +39,10 @@ pub(super) enum ImageColumnFamily {
 pub(super) enum MetaData {
     TotalFeatures,
     TotalImages,
+    /// `IdRanges` of indexed features, only used with a `FeatureStore`
+    IndexedRanges,
+    /// `IdRanges` of features removed by `clear_cache`, only used with a `FeatureStore`
+    ClearedRanges,
 }
 
 impl ImageColumnFamily {
@@ -69,14 +83,73 @@ impl AsRef<[u8]> for MetaData {
         match self {
             Self::TotalFeatures => b"total_features",
             Self::TotalImages => b"total_images",
+            Self::IndexedRanges => b"indexed_ranges",
+            Self::ClearedRanges => b"cleared_ranges",
         }
     }
 }
 
+/// Key-value entries of a batch of images, by column family
+#[derive(Default)]
+struct ImageRecords {
+    new_feature: Vec<(Vec<u8>, Vec<u8>)>,
+    id_to_image_id: Vec<(Vec<u8>, Vec<u8>)>,
+    id_to_image: Vec<(Vec<u8>, Vec<u8>)>,
+    image_list: Vec<(Vec<u8>, Vec<u8>)>,
+}
+
+impl ImageRecords {
+    fn append(&mut self, other: Self) {
+        self.new_feature.extend(other.new_feature);
+        self.id_to_image_id.extend(other.id_to_image_id);
+        self.id_to_image.extend(other.id_to_image);
+        self.image_list.extend(other.image_list);
+    }
+
+    fn bytes(&self) -> usize {
+        [
+            &self.new_feature,
+            &self.id_to_image_id,
+            &self.id_to_image,
+            &self.image_list,
+        ]
+        .iter()
+        .flat_map(|entries| entries.iter())
+        .map(|(key, value)| key.len() + value.len())
+        .sum()
+    }
+
+    /// ImageList comes last, an image is only visible once everything else is written
+    fn into_families(self) -> Vec<(ImageColumnFamily, Vec<(Vec<u8>, Vec<u8>)>)> {
+        vec![
+            (ImageColumnFamily::NewFeature, self.new_feature),
+            (ImageColumnFamily::IdToImageId, self.id_to_image_id),
+            (ImageColumnFamily::IdToImage, self.id_to_image),
+            (ImageColumnFamily::ImageList, self.image_list),
+        ]
+    }
+}
+
+/// Images of `ingest_images` which are not ingested yet
+///
+/// Keys of ids are little-endian, so the records of consecutive batches overlap over the whole
+/// key space, and every ingested file stays in L0 until it is compacted. Batches are gathered into
+/// a few large files to keep L0 short.
+#[derive(Default)]
+struct IngestBuffer {
+    records: ImageRecords,
+    /// Hashes of the buffered images, which are not in ImageList yet
+    hashes: HashSet<Vec<u8>>,
+    bytes: usize,
+}
+
 pub struct ImageDB {
     db: DB,
     total_images: AtomicU64,
     total_features: AtomicU64,
+    /// Features are kept in RocksDB (NewFeature, IdToFeature and IdToImageId) without it
+    store: Option<FeatureStore>,
+    ingest: Mutex<IngestBuffer>,
 }
 
 impl ImageDB {
@@ -105,10 +178,17 @@ impl ImageDB {
         // meta_data borrows db here
         drop(meta_data);
 
+        let store = match path.features().exists() {
+            true => Some(FeatureStore::open(&path.features(), read_only)?),
+            false => None,
+        };
+
         Ok(Self {
             db,
             total_images: AtomicU64::new(total_images),
             total_features: AtomicU64::new(total_features),
+            store,
+            ingest: Mutex::default(),
         })
     }
 
@@ -124,9 +204,30 @@ impl ImageDB {
         Ok(self.db.put_cf(&id_to_image, image_id.to_le_bytes(), path)?)
     }
 
+    /// Check whether a batch of images exist with a single multi_get
+    pub fn find_image_ids_by_hashes(&self, hashes: &[&[u8]]) -> Result<Vec<Option<i32>>> {
+        let image_list = self.cf(ImageColumnFamily::ImageList);
+        self.db
+            .multi_get_cf(hashes.iter().map(|hash| (&image_list, hash)))
+            .into_iter()
+            .map(|value| Ok(value?.map(bytes_to_i32)))
+            .collect()
+    }
+
+    /// Update the paths of a batch of images in one write
+    pub fn update_image_paths<S: AsRef<str>>(&self, images: &[(i32, S)]) -> Result<()> {
+        let id_to_image = self.cf(ImageColumnFamily::IdToImage);
+        let mut batch = WriteBatch::default();
+        for (image_id, path) in images {
+            batch.put_cf(&id_to_image, image_id.to_le_bytes(), path.as_ref());
+        }
+        Ok(self.db.write(batch)?)
+    }
+
     /// Add an image and its features to database
     ///
-    /// return false if the image is already inserted
+    /// return false if the image is already inserted. With a `FeatureStore`, call `sync` after
+    /// the last image, before its features are indexed
     pub fn add_image<S, T>(&self, path: S, hash: &[u8], features: T) -> Result<bool>
     where
         S: AsRef<str>,
@@ -149,18 +250,205 @@ impl ImageDB {
 
         // insert feature_id => feature to NewFeature
         // insert feature_id => image_id
-        for feature in features.iter_lines() {
-            let id = self.total_features.fetch_add(1, Ordering::SeqCst);
-            batch.put_cf(&new_feature, id.to_le_bytes(), feature);
-            batch.put_cf(&id_to_image_id, id.to_le_bytes(), image_id.to_le_bytes());
+        // the ids of all features are reserved at once
+        let mut id = self
+            .total_features
+            .fetch_add(features.height() as u64, Ordering::SeqCst);
+        if let Some(store) = &self.store {
+            // not synced here, callers adding many images call `sync` once for all of them
+            store.write(id, image_id, &features)?;
+        } else {
+            for feature in features.iter_lines() {
+                batch.put_cf(&new_feature, id.to_le_bytes(), feature);
+                batch.put_cf(&id_to_image_id, id.to_le_bytes(), image_id.to_le_bytes());
+                id += 1;
+            }
         }
         // insert image_hash => image_id
         batch.put_cf(&image_list, hash, image_id.to_le_bytes());
 
+        self.put_meta_data(&mut batch);
+        self.db.write(batch)?;
+
+        Ok(true)
+    }
+
+    /// Flush features written by `add_image` to disk, and ingest the images buffered by
+    /// `ingest_images`
+    pub fn sync(&self) -> Result<()> {
+        if let Some(store) = &self.store {
+            store.sync()?;
+        }
+        self.ingest_buffer(&mut self.ingest.lock().unwrap())
+    }
+
+    /// Add a batch of images and their features in a single write
+    ///
+    /// Return false for the images which are already inserted
+    pub fn add_images<S, T>(&self, images: &[(S, &[u8], T)]) -> Result<Vec<bool>>
+    where
+        S: AsRef<str>,
+        T: Matrix,
+    {
+        let (added, records) = self.prepare_images(images, &self.ingest.lock().unwrap().hashes)?;
+
+        let mut batch = WriteBatch::default();
+        for (family, entries) in records.into_families() {
+            let cf = self.cf(family);
+            for (key, value) in entries {
+                batch.put_cf(&cf, key, value);
+            }
+        }
+        self.put_meta_data(&mut batch);
+        self.db.write(batch)?;
+
+        Ok(added)
+    }
+
+    /// Like `add_images`, but gather the images into large SST files and ingest them, bypassing
+    /// the memtable and WAL
+    ///
+    /// This is meant for initial loads, where most of the write cost is compaction. Images are
+    /// buffered until `INGEST_BUFFER_BYTES`, call `sync` after the last batch to ingest the rest
+    pub fn ingest_images<S, T>(&self, images: &[(S, &[u8], T)]) -> Result<Vec<bool>>
+    where
+        S: AsRef<str>,
+        T: Matrix,
+    {
+        let mut buffer = self.ingest.lock().unwrap();
+        let (added, records) = self.prepare_images(images, &buffer.hashes)?;
+        for ((_, hash, _), &added) in images.iter().zip(&added) {
+            if added {
+                buffer.hashes.insert(hash.to_vec());
+            }
+        }
+        buffer.bytes += records.bytes();
+        buffer.records.append(records);
+        if buffer.bytes >= INGEST_BUFFER_BYTES {
+            self.ingest_buffer(&mut buffer)?;
+        }
+        Ok(added)
+    }
+
+    /// Write the buffered images to SST files and ingest them
+    fn ingest_buffer(&self, buffer: &mut IngestBuffer) -> Result<()> {
+        if buffer.hashes.is_empty() {
+            return Ok(());
+        }
+        let records = std::mem::take(buffer).records;
+        let options = default_options();
+        let dir = tempfile::tempdir()?;
+        let mut ingest_options = IngestExternalFileOptions::default();
+        ingest_options.set_move_files(true);
+
+        for (family, mut entries) in records.into_families() {
+            if entries.is_empty() {
+                continue;
+            }
+            // SST files must be written in key order, then consecutive files don't overlap and
+            // are ingested together
+            entries.sort_unstable_by(|a, b| a.0.cmp(&b.0));
+            let mut paths = vec![];
+            let mut start = 0;
+            while start < entries.len() {
+                let mut end = start;
+                let mut bytes = 0;
+                while end < entries.len() && bytes < INGEST_SST_BYTES {
+                    bytes += entries[end].0.len() + entries[end].1.len();
+                    end += 1;
+                }
+                let path = dir
+                    .path()
+                    .join(format!("{}-{}.sst", family.as_ref(), paths.len()));
+                let mut writer = SstFileWriter::create(&options);
+                writer.open(&path)?;
+                for (key, value) in entries[start..end].iter() {
+                    writer.put(key, value)?;
+                }
+                writer.finish()?;
+                paths.push(path);
+                start = end;
+            }
+            debug!("ingesting {} files into {}", paths.len(), family.as_ref());
+            self.db
+                .ingest_external_file_cf_opts(&self.cf(family), &ingest_options, paths)?;
+        }
+
+        let mut batch = WriteBatch::default();
+        self.put_meta_data(&mut batch);
+        self.db.write(batch)?;
+        Ok(())
+    }
+
+    /// Reserve ids for a batch of images, and collect all entries to write
+    ///
+    /// Images in `pending` are buffered for ingestion, and are not added again
+    fn prepare_images<S, T>(
+        &self,
+        images: &[(S, &[u8], T)],
+        pending: &HashSet<Vec<u8>>,
+    ) -> Result<(Vec<bool>, ImageRecords)>
+    where
+        S: AsRef<str>,
+        T: Matrix,
+    {
+        let image_list = self.cf(ImageColumnFamily::ImageList);
+
+        let mut seen = HashSet::new();
+        let mut added = Vec::with_capacity(images.len());
+        for (_, hash, _) in images {
+            added.push(
+                seen.insert(*hash)
+                    && !pending.contains(*hash)
+                    && self.db.get_cf(&image_list, hash)?.is_none(),
+            );
+        }
+
+        let new_images = images.iter().zip(&added).filter(|(_, &added)| added);
+        let total_images = new_images.clone().count() as u64;
+        let total_features = new_images
+            .clone()
+            .map(|((_, _, features), _)| features.height() as u64)
+            .sum::<u64>();
+
+        // the ids of the whole batch are reserved at once
+        let mut image_id = self.total_images.fetch_add(total_images, Ordering::SeqCst) as i32;
+        let mut feature_id = self
+            .total_features
+            .fetch_add(total_features, Ordering::SeqCst);
+
+        let mut records = ImageRecords::default();
+        for ((path, hash, features), _) in new_images {
+            let image_id_bytes = image_id.to_le_bytes().to_vec();
+            records
+                .id_to_image
+                .push((image_id_bytes.clone(), path.as_ref().as_bytes().to_vec()));
+            if let Some(store) = &self.store {
+                store.write(feature_id, image_id, features)?;
+                feature_id += features.height() as u64;
+            } else {
+                for feature in features.iter_lines() {
+                    let id = feature_id.to_le_bytes().to_vec();
+                    records.new_feature.push((id.clone(), feature.to_vec()));
+                    records.id_to_image_id.push((id, image_id_bytes.clone()));
+                    feature_id += 1;
+                }
+            }
+            records.image_list.push((hash.to_vec(), image_id_bytes));
+            image_id += 1;
+        }
+        if let Some(store) = &self.store {
+            store.sync()?;
+        }
+
+        Ok((added, records))
+    }
+
+    /// update total_images and total_features
+    fn put_meta_data(&self, batch: &mut WriteBatch) {
         let total_images = self.total_images.load(Ordering::SeqCst);
         let total_features = self.total_features.load(Ordering::SeqCst);
 
-        // update total_images and total_features
         let meta_data = self.cf(ImageColumnFamily::MetaData);
         batch.put_cf(
             &meta_data,
@@ -172,24 +460,80 @@ impl ImageDB {
             MetaData::TotalFeatures,
             total_features.to_le_bytes(),
         );
-
-        self.db.write(batch)?;
-
-        Ok(true)
     }
 
     /// Return an iterator of features
-    pub fn features(&self, indexed: bool) -> impl Iterator<Item = (u64, Box<[u8]>)> + '_ {
+    pub fn features(&self, indexed: bool) -> Box<dyn Iterator<Item = (u64, Box<[u8]>)> + '_> {
+        if let Some(store) = &self.store {
+            let descriptors = store.descriptors().expect("failed to map descriptors");
+            let indexed_ranges = self
+                .id_ranges(MetaData::IndexedRanges)
+                .expect("failed to read indexed ranges");
+            // the descriptors of cleared features are zeroed holes
+            let cleared_ranges = self
+                .id_ranges(MetaData::ClearedRanges)
+                .expect("failed to read cleared ranges");
+            let width = FeatureStore::WIDTH;
+            let total = self
+                .total_features()
+                .min((descriptors.len() / width) as u64);
+            return Box::new(
+                (0..total)
+                    .filter(move |&id| {
+                        indexed_ranges.contains(id) == indexed && !cleared_ranges.contains(id)
+                    })
+                    .map(move |id| {
+                        let start = id as usize * width;
+                        let feature = &descriptors.as_slice()[start..start + width];
+                        (id, feature.into())
+                    }),
+            );
+        }
+
         let family = match indexed {
             true => ImageColumnFamily::IdToFeature,
             false => ImageColumnFamily::NewFeature,
         };
-        self.db
-            .iterator_cf_opt(&self.cf(family), Self::read_opts(), IteratorMode::Start)
-            .map(|item| (bytes_to_u64(item.0), item.1))
+        Box::new(
+            self.db
+                .iterator_cf_opt(&self.cf(family), Self::read_opts(), IteratorMode::Start)
+                .map(|item| (bytes_to_u64(item.0), item.1)),
+        )
+    }
+
+    /// Ranges of features which are indexed, only used with a `FeatureStore`
+    fn indexed_ranges(&self) -> Result<IdRanges> {
+        self.id_ranges(MetaData::IndexedRanges)
+    }
+
+    fn put_indexed_ranges(&self, ranges: &IdRanges) -> Result<()> {
+        self.put_id_ranges(MetaData::IndexedRanges, ranges)
+    }
+
+    fn id_ranges(&self, key: MetaData) -> Result<IdRanges> {
+        let meta_data = self.cf(ImageColumnFamily::MetaData);
+        Ok(self
+            .db
+            .get_cf(&meta_data, key)?
+            .map(|bytes| IdRanges::from_bytes(&bytes))
+            .unwrap_or_default())
+    }
+
+    fn put_id_ranges(&self, key: MetaData, ranges: &IdRanges) -> Result<()> {
+        let meta_data = self.cf(ImageColumnFamily::MetaData);
+        self.db.put_cf(&meta_data, key, ranges.to_bytes())?;
+        Ok(())
     }
 
-    fn find_image_id_by_id(&self, feature_id: u64) -> Result<Option<i32>> {
+    /// Path of a feature id to image id table that is kept up to date while adding images
+    pub fn image_id_table_path(&self) -> Option<&Path> {
+        self.store.as_ref().map(|store| store.image_ids_path())
+    }
+
+    pub fn find_image_id_by_id(&self, feature_id: u64) -> Result<Option<i32>> {
+        if let Some(store) = &self.store {
+            return store.image_id(feature_id);
+        }
         let id_to_image_id = self.cf(ImageColumnFamily::IdToImageId);
         Ok(self
             .db
@@ -199,34 +543,179 @@ impl ImageDB {
 
     /// Find image according to feature id
     pub fn find_image_path(&self, feature_id: u64) -> Result<String> {
+        let image_id = match self.find_image_id_by_id(feature_id)? {
+            Some(image_id) => image_id,
+            None => bail!("feature {} not found", feature_id),
+        };
+        match self.image_path(image_id)? {
+            Some(path) => Ok(path),
+            None => bail!("image {} not found", image_id),
+        }
+    }
+
+    /// Find image according to image id, None if there is no such image
+    pub fn image_path(&self, image_id: i32) -> Result<Option<String>> {
         let id_to_image = self.cf(ImageColumnFamily::IdToImage);
-        let image_id = self.find_image_id_by_id(feature_id)?.unwrap();
-        Ok(self
-            .db
-            .get_cf(&id_to_image, image_id.to_le_bytes())
-            .map(|data| String::from_utf8(data.unwrap()).unwrap())?)
+        match self.db.get_cf(&id_to_image, image_id.to_le_bytes())? {
+            Some(data) => Ok(Some(String::from_utf8(data)?)),
+            None => Ok(None),
+        }
+    }
+
+    /// Return the image id of every feature, indexed by feature id
+    pub fn image_ids(&self) -> Vec<u32> {
+        if let Some(path) = self.image_id_table_path() {
+            let table = ImageIdTable::open(path).expect("failed to open image id table");
+            return (0..self.total_features())
+                .map(|id| table.get(id).unwrap_or(ImageIdTable::MISSING))
+                .collect();
+        }
+        let id_to_image_id = self.cf(ImageColumnFamily::IdToImageId);
+        let mut ids = vec![ImageIdTable::MISSING; self.total_features() as usize];
+        for (id, image_id) in
+            self.db
+                .iterator_cf_opt(&id_to_image_id, Self::read_opts(), IteratorMode::Start)
+        {
+            let id = bytes_to_u64(id) as usize;
+            // the iterator may see features added after total_features was loaded
+            if id < ids.len() {
+                ids[id] = bytes_to_i32(image_id) as u32;
+            }
+        }
+        ids
     }
 
     /// Mark a list of features as trained
     pub fn mark_as_indexed(&self, ids: &[u64]) -> Result<()> {
+        if self.store.is_some() {
+            let mut ranges = self.indexed_ranges()?;
+            ranges.insert_ids(ids);
+            return self.put_indexed_ranges(&ranges);
+        }
+
+        let new_feature = self.cf(ImageColumnFamily::NewFeature);
+
+        // sorted keys are read in one pass over the same blocks
+        let mut keys = ids.iter().map(|id| id.to_le_bytes()).collect::<Vec<_>>();
+        keys.sort_unstable();
+        let values = self
+            .db
+            .multi_get_cf(keys.iter().map(|key| (&new_feature, key)));
+
+        let mut features = Vec::with_capacity(keys.len());
+        for (key, value) in keys.iter().zip(values) {
+            match value? {
+                Some(feature) => features.push((bytes_to_u64(key), feature)),
+                None => bail!("feature {} not found", bytes_to_u64(key)),
+            }
+        }
+        self.move_to_indexed(features.iter().map(|(id, feature)| (*id, &feature[..])))
+    }
+
+    /// Mark features as indexed with the values already read from `features(false)`
+    pub fn move_to_indexed<'a, I>(&self, features: I) -> Result<()>
+    where
+        I: IntoIterator<Item = (u64, &'a [u8])>,
+    {
+        if self.store.is_some() {
+            let ids = features.into_iter().map(|(id, _)| id).collect::<Vec<_>>();
+            return self.mark_as_indexed(&ids);
+        }
+
+        let new_feature = self.cf(ImageColumnFamily::NewFeature);
+        let id_to_feature = self.cf(ImageColumnFamily::IdToFeature);
+
+        let mut batch = WriteBatch::default();
+        for (id, feature) in features {
+            let key = id.to_le_bytes();
+            batch.delete_cf(&new_feature, key);
+            batch.put_cf(&id_to_feature, key, feature);
+        }
+        self.db.write(batch)?;
+
+        Ok(())
+    }
+
+    /// Mark all features in [0, max_feature_id) as indexed, in batches of `batch_size`
+    ///
+    /// Features are streamed from NewFeature, so nothing is read twice. If this covers every
+    /// feature, NewFeature is emptied with a single range deletion instead of one tombstone per
+    /// key. Keys are little endian, so a partial id range is not continuous and is deleted key by
+    /// key.
+    pub fn mark_range_as_indexed(&self, max_feature_id: u64, batch_size: usize) -> Result<()> {
+        if self.store.is_some() {
+            let mut ranges = self.indexed_ranges()?;
+            ranges.insert(0, max_feature_id.min(self.total_features()));
+            return self.put_indexed_ranges(&ranges);
+        }
+
         let new_feature = self.cf(ImageColumnFamily::NewFeature);
         let id_to_feature = self.cf(ImageColumnFamily::IdToFeature);
+        let whole = max_feature_id >= self.total_features();
 
         let mut batch = WriteBatch::default();
-        // TODO: use multi_get_cf
-        for id in ids {
-            let id = id.to_le_bytes();
-            let feature = self.db.get_pinned_cf(&new_feature, id)?.unwrap();
-            batch.delete_cf(&new_feature, id);
-            batch.put_cf(&id_to_feature, id, feature);
+        let mut moved = 0;
+        for (id, feature) in self.features(false) {
+            if id >= max_feature_id {
+                continue;
+            }
+            let key = id.to_le_bytes();
+            batch.put_cf(&id_to_feature, key, feature);
+            // keep NewFeature as is until all features are copied
+            if !whole {
+                batch.delete_cf(&new_feature, key);
+            }
+            moved += 1;
+            if moved % batch_size.max(1) == 0 {
+                info!("mark as indexed: {}", moved);
+                self.db.write(std::mem::take(&mut batch))?;
+            }
         }
+
+        if whole {
+            // the end of a range deletion is exclusive, so the largest key is deleted on its own
+            batch.delete_range_cf(&new_feature, [0u8; 8], [0xffu8; 8]);
+            batch.delete_cf(&new_feature, [0xffu8; 8]);
+        }
+        info!("mark as indexed: {}", moved);
         self.db.write(batch)?;
+        if whole {
+            // SST files covered by the range deletion are dropped without being rewritten
+            self.db
+                .compact_range_cf(&new_feature, None::<&[u8]>, None::<&[u8]>);
+        }
 
         Ok(())
     }
 
     /// Delete features
     pub fn clear_cache(&self, indexed: bool) -> Result<()> {
+        if let Some(store) = &self.store {
+            // descriptors are not removed from the store, only their disk space is released
+            let total = self.total_features();
+            let ranges = self.indexed_ranges()?;
+            let mut cleared = self.id_ranges(MetaData::ClearedRanges)?;
+            let mut holes = vec![];
+            let mut next = 0;
+            for &(start, end) in ranges.ranges() {
+                match indexed {
+                    true => holes.push((start, end)),
+                    false if next < start => holes.push((next, start)),
+                    false => {}
+                }
+                next = end;
+            }
+            if !indexed && next < total {
+                holes.push((next, total));
+            }
+            for &(start, end) in holes.iter() {
+                store.punch_hole(start, end)?;
+                // the holes read as zeros, so `features` skips them
+                cleared.insert(start, end);
+            }
+            return self.put_id_ranges(MetaData::ClearedRanges, &cleared);
+        }
+
         let cf = match indexed {
             true => ImageColumnFamily::IdToFeature,
             _ => ImageColumnFamily::NewFeature,
@@ -255,3 +744,81 @@ impl ImageDB {
         self.db.cf_handle(cf.as_ref()).unwrap()
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use std::str::FromStr;
+
+    use super::ImageDB;
+    use crate::config::ConfDir;
+    use crate::matrix::MatrixView;
+
+    /// Everything that can be read back of the images, by hash
+    fn read_back(db: &ImageDB, hashes: &[[u8; 32]]) -> Vec<(String, Vec<(u64, Vec<u8>)>)> {
+        let features = db.features(false).collect::<Vec<_>>();
+        hashes
+            .iter()
+            .map(|hash| {
+                let image_id = db.find_image_id_by_hash(hash).unwrap().unwrap();
+                let features = features
+                    .iter()
+                    .filter(|(id, _)| db.find_image_id_by_id(*id).unwrap() == Some(image_id))
+                    .map(|(id, feature)| (*id, feature.to_vec()))
+                    .collect();
+                (db.image_path(image_id).unwrap().unwrap(), features)
+            })
+            .collect()
+    }
+
+    #[test]
+    fn ingest_images_match_add_images() {
+        // the first and last batches share an image, which must only be added once
+        let hashes = (0..40u8)
+            .map(|i| [i; 32])
+            .chain(Some([3; 32]))
+            .collect::<Vec<_>>();
+        let data = (0..hashes.len())
+            .map(|i| {
+                (0..i % 7 * 32)
+                    .map(|j| (i * 13 + j) as u8)
+                    .collect::<Vec<_>>()
+            })
+            .collect::<Vec<_>>();
+        let images = hashes
+            .iter()
+            .zip(&data)
+            .enumerate()
+            .map(|(i, (hash, data))| (format!("{}.png", i), &hash[..], MatrixView::new(32, data)))
+            .collect::<Vec<_>>();
+
+        // v3 databases keep their features in RocksDB, v4 ones in a FeatureStore
+        for &version in &["3", "4"] {
+            let open = |ingest: bool| {
+                let dir = tempfile::tempdir().unwrap();
+                if version == "3" {
+                    std::fs::write(dir.path().join("version"), version).unwrap();
+                }
+                let conf_dir = ConfDir::from_str(dir.path().to_str().unwrap()).unwrap();
+                let db = ImageDB::open(&conf_dir, false).unwrap();
+                let added = images
+                    .chunks(16)
+                    .flat_map(|chunk| match ingest {
+                        true => db.ingest_images(chunk).unwrap(),
+                        false => db.add_images(chunk).unwrap(),
+                    })
+                    .collect::<Vec<_>>();
+                db.sync().unwrap();
+                (dir, db, added)
+            };
+            let (_added_dir, added_db, added) = open(false);
+            let (_ingested_dir, ingested_db, ingested) = open(true);
+            assert_eq!(added, ingested);
+            assert!(!ingested[ingested.len() - 1]);
+            assert_eq!(added_db.total_features(), ingested_db.total_features());
+            assert_eq!(
+                read_back(&added_db, &hashes[..40]),
+                read_back(&ingested_db, &hashes[..40])
+            );
+        }
+    }
+}
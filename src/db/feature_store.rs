@@ -0,0 +1,197 @@
+use std::fs::{File, OpenOptions};
+use std::os::unix::fs::FileExt;
+use std::os::unix::io::AsRawFd;
+use std::path::{Path, PathBuf};
+
+use super::mmap::Mmap;
+use crate::matrix::Matrix;
+use anyhow::Result;
+
+/// Append-only columnar storage of features
+///
+/// `descriptors` holds the 32 bytes of feature `i` at offset `32 * i`, and `image_ids` holds its
+/// image id at offset `4 * i`, in the format of `ImageIdTable`. Ids are reserved by the database
+/// before writing, so writers never overlap and need no lock.
+pub struct FeatureStore {
+    descriptors: File,
+    image_ids: File,
+    image_ids_path: PathBuf,
+}
+
+impl FeatureStore {
+    pub const WIDTH: usize = 32;
+
+    pub fn open(dir: &Path, read_only: bool) -> Result<Self> {
+        let mut options = OpenOptions::new();
+        options.read(true).write(!read_only).create(!read_only);
+        let image_ids_path = dir.join("image_ids");
+        Ok(Self {
+            descriptors: options.open(dir.join("descriptors"))?,
+            image_ids: options.open(&image_ids_path)?,
+            image_ids_path,
+        })
+    }
+
+    /// Write the features of one image, the first one has id `first`
+    pub fn write<M: Matrix>(&self, first: u64, image_id: i32, features: &M) -> Result<()> {
+        if features.height() == 0 {
+            return Ok(());
+        }
+        assert_eq!(features.width(), Self::WIDTH);
+        // SAFETY: a Matrix is a continuous array of height * width bytes
+        let data = unsafe {
+            std::slice::from_raw_parts(features.as_ptr(), features.width() * features.height())
+        };
+        self.descriptors
+            .write_all_at(data, first * Self::WIDTH as u64)?;
+
+        let image_ids = (image_id as u32).to_ne_bytes().repeat(features.height());
+        self.image_ids.write_all_at(&image_ids, first * 4)?;
+        Ok(())
+    }
+
+    /// Flush written features to disk, must be called before they are referenced by the database
+    pub fn sync(&self) -> Result<()> {
+        self.descriptors.sync_data()?;
+        self.image_ids.sync_data()?;
+        Ok(())
+    }
+
+    /// Map all descriptors written so far
+    pub fn descriptors(&self) -> Result<Mmap> {
+        Mmap::open(&self.descriptors)
+    }
+
+    /// Path of the image id array, which can be opened by `ImageIdTable`
+    pub fn image_ids_path(&self) -> &Path {
+        &self.image_ids_path
+    }
+
+    pub fn image_id(&self, feature_id: u64) -> Result<Option<i32>> {
+        let mut buf = [0u8; 4];
+        match self.image_ids.read_exact_at(&mut buf, feature_id * 4) {
+            Ok(()) => Ok(Some(u32::from_ne_bytes(buf) as i32)),
+            Err(e) if e.kind() == std::io::ErrorKind::UnexpectedEof => Ok(None),
+            Err(e) => Err(e.into()),
+        }
+    }
+
+    /// Release the disk space of descriptors in [start, end), ids are not reused
+    pub fn punch_hole(&self, start: u64, end: u64) -> Result<()> {
+        let width = Self::WIDTH as i64;
+        let ret = unsafe {
+            libc::fallocate(
+                self.descriptors.as_raw_fd(),
+                libc::FALLOC_FL_PUNCH_HOLE | libc::FALLOC_FL_KEEP_SIZE,
+                start as i64 * width,
+                (end - start) as i64 * width,
+            )
+        };
+        if ret != 0 {
+            return Err(std::io::Error::last_os_error().into());
+        }
+        Ok(())
+    }
+}
+
+/// A set of feature ids, stored as sorted and disjoint [start, end) ranges
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct IdRanges(Vec<(u64, u64)>);
+
+impl IdRanges {
+    pub fn from_bytes(bytes: &[u8]) -> Self {
+        let ranges = bytes
+            .chunks_exact(16)
+            .map(|chunk| {
+                let mut start = [0u8; 8];
+                let mut end = [0u8; 8];
+                start.copy_from_slice(&chunk[..8]);
+                end.copy_from_slice(&chunk[8..]);
+                (u64::from_le_bytes(start), u64::from_le_bytes(end))
+            })
+            .collect();
+        Self(ranges)
+    }
+
+    pub fn to_bytes(&self) -> Vec<u8> {
+        let mut bytes = Vec::with_capacity(self.0.len() * 16);
+        for (start, end) in self.0.iter() {
+            bytes.extend_from_slice(&start.to_le_bytes());
+            bytes.extend_from_slice(&end.to_le_bytes());
+        }
+        bytes
+    }
+
+    pub fn ranges(&self) -> &[(u64, u64)] {
+        &self.0
+    }
+
+    pub fn contains(&self, id: u64) -> bool {
+        match self.0.binary_search_by(|&(start, _)| start.cmp(&id)) {
+            Ok(_) => true,
+            Err(0) => false,
+            Err(i) => id < self.0[i - 1].1,
+        }
+    }
+
+    /// Add all ids in [start, end)
+    pub fn insert(&mut self, start: u64, end: u64) {
+        if start >= end {
+            return;
+        }
+        let mut merged = Vec::with_capacity(self.0.len() + 1);
+        let (mut start, mut end) = (start, end);
+        for &(s, e) in self.0.iter() {
+            if e < start || s > end {
+                merged.push((s, e));
+            } else {
+                start = start.min(s);
+                end = end.max(e);
+            }
+        }
+        merged.push((start, end));
+        merged.sort_unstable();
+        self.0 = merged;
+    }
+
+    /// Add a list of ids, runs of consecutive ids are inserted as one range
+    pub fn insert_ids(&mut self, ids: &[u64]) {
+        let mut ids = ids.to_vec();
+        ids.sort_unstable();
+        let mut iter = ids.into_iter();
+        let mut run = match iter.next() {
+            Some(id) => (id, id + 1),
+            None => return,
+        };
+        for id in iter {
+            if id <= run.1 {
+                run.1 = run.1.max(id + 1);
+            } else {
+                self.insert(run.0, run.1);
+                run = (id, id + 1);
+            }
+        }
+        self.insert(run.0, run.1);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::IdRanges;
+
+    #[test]
+    fn id_ranges() {
+        let mut ranges = IdRanges::default();
+        ranges.insert_ids(&[5, 1, 2, 3, 9]);
+        assert_eq!(ranges.ranges(), &[(1, 4), (5, 6), (9, 10)]);
+        ranges.insert(4, 5);
+        assert_eq!(ranges.ranges(), &[(1, 6), (9, 10)]);
+        ranges.insert(0, 20);
+        assert_eq!(ranges.ranges(), &[(0, 20)]);
+
+        assert!(ranges.contains(0));
+        assert!(ranges.contains(19));
+        assert!(!ranges.contains(20));
+        assert_eq!(IdRanges::from_bytes(&ranges.to_bytes()), ranges);
+    }
+}
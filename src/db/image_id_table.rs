@@ -0,0 +1,61 @@
+use std::fs::File;
+use std::io::Write;
+use std::path::Path;
+
+use super::mmap::Mmap;
+use anyhow::{bail, Result};
+
+/// A flat array mapping feature id to image id, read with mmap
+///
+/// The file is just `total_features` native-endian u32, features without an image are `u32::MAX`
+pub struct ImageIdTable {
+    map: Mmap,
+}
+
+impl ImageIdTable {
+    pub const MISSING: u32 = u32::MAX;
+
+    /// Map a table written by `ImageIdTable::write`
+    pub fn open<P: AsRef<Path>>(path: P) -> Result<Self> {
+        let file = File::open(path.as_ref())?;
+        let map = Mmap::open(&file)?;
+        if map.len() % 4 != 0 {
+            bail!("broken image id table: {}", path.as_ref().display());
+        }
+        Ok(Self { map })
+    }
+
+    /// Write a table through a temporary file, `ids[feature_id]` is the image id of the feature
+    pub fn write<P: AsRef<Path>>(path: P, ids: &[u32]) -> Result<()> {
+        let mut tmp_file = path.as_ref().to_path_buf();
+        tmp_file.set_extension("tmp");
+
+        let bytes = unsafe { std::slice::from_raw_parts(ids.as_ptr() as *const u8, ids.len() * 4) };
+        let mut file = File::create(&tmp_file)?;
+        file.write_all(bytes)?;
+        file.sync_all()?;
+        std::fs::rename(&tmp_file, path)?;
+        Ok(())
+    }
+
+    /// Number of features in the table
+    pub fn len(&self) -> usize {
+        self.map.len() / 4
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Return the image id of a feature
+    pub fn get(&self, feature_id: u64) -> Option<u32> {
+        if feature_id >= self.len() as u64 {
+            return None;
+        }
+        // SAFETY: the map is page aligned, and feature_id is in range
+        match unsafe { *(self.map.as_ptr() as *const u32).add(feature_id as usize) } {
+            Self::MISSING => None,
+            image_id => Some(image_id),
+        }
+    }
+}
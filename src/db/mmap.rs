@@ -0,0 +1,72 @@
+use std::fs::File;
+use std::os::unix::io::AsRawFd;
+use std::ptr;
+
+use anyhow::Result;
+
+/// A read-only, page aligned memory map of a whole file
+pub struct Mmap {
+    data: *const u8,
+    len: usize,
+}
+
+unsafe impl Send for Mmap {}
+unsafe impl Sync for Mmap {}
+
+impl Mmap {
+    /// Map the current content of a file, later appends are not visible
+    pub fn open(file: &File) -> Result<Self> {
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            return Ok(Self {
+                data: ptr::NonNull::dangling().as_ptr(),
+                len: 0,
+            });
+        }
+
+        let data = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if data == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error().into());
+        }
+
+        Ok(Self {
+            data: data as *const u8,
+            len,
+        })
+    }
+
+    pub fn as_slice(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.data, self.len) }
+    }
+
+    pub fn as_ptr(&self) -> *const u8 {
+        self.data
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+}
+
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        if self.len != 0 {
+            unsafe {
+                libc::munmap(self.data as *mut libc::c_void, self.len);
+            }
+        }
+    }
+}
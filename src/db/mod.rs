@@ -1,5 +1,9 @@
 mod database;
+mod feature_store;
+mod image_id_table;
+mod mmap;
 mod update;
 mod utils;
 
 pub use database::ImageDB;
+pub use image_id_table::ImageIdTable;
@@ -19,15 +19,17 @@ pub fn check_db_update(path: &ConfDir) -> Result<()> {
         // update_from_2_to_3(path)?;
         std::fs::write(path.version(), "3")?;
     }
+    // v4 keeps features in a columnar store instead of RocksDB, v3 databases are left as is
     if !version_file.exists() {
-        std::fs::create_dir_all(path.path())?;
-        std::fs::write(path.version(), "3")?;
+        std::fs::create_dir_all(path.features())?;
+        std::fs::write(path.version(), "4")?;
     }
 
     let version = std::fs::read_to_string(version_file)?;
 
     match version.as_str() {
         "3" => {}
+        "4" => {}
         _ => {}
     }
 
@@ -0,0 +1,44 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// Copyright 2004-present Facebook. All Rights Reserved.
+// -*- c -*-
+
+#ifndef FAISS_AUX_INDEX_STRUCTURES_C_H
+#define FAISS_AUX_INDEX_STRUCTURES_C_H
+
+#include <stddef.h>
+#include "Index_c.h"
+#include "faiss_c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// number of queries
+FAISS_DECLARE_GETTER(RangeSearchResult, size_t, nq)
+
+/// Create a result table for nq queries, filled by a range search
+int faiss_RangeSearchResult_new(FaissRangeSearchResult** p_rsr, idx_t nq);
+
+FAISS_DECLARE_DESTRUCTOR(RangeSearchResult)
+
+/// getter for lims: size (nq + 1), results of query i are in [lims[i], lims[i + 1])
+void faiss_RangeSearchResult_lims(FaissRangeSearchResult* rsr, size_t** lims);
+
+/// getter for labels and respective distances (not sorted): result for query i
+/// is labels[lims[i]:lims[i+1]]
+void faiss_RangeSearchResult_labels(
+        FaissRangeSearchResult* rsr,
+        idx_t** labels,
+        float** distances);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
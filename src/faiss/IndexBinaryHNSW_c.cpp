@@ -0,0 +1,39 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// Copyright 2004-present Facebook. All Rights Reserved.
+// -*- c++ -*-
+
+#include "IndexBinaryHNSW_c.h"
+#include <faiss/IndexBinaryHNSW.h>
+#include "macros_impl.h"
+
+extern "C" {
+
+using faiss::IndexBinaryHNSW;
+
+DEFINE_DESTRUCTOR(IndexBinaryHNSW)
+DEFINE_INDEX_BINARY_DOWNCAST(IndexBinaryHNSW)
+
+int faiss_IndexBinaryHNSW_efSearch(const FaissIndexBinaryHNSW* index) {
+    return reinterpret_cast<const IndexBinaryHNSW*>(index)->hnsw.efSearch;
+}
+
+void faiss_IndexBinaryHNSW_set_efSearch(FaissIndexBinaryHNSW* index, int ef) {
+    reinterpret_cast<IndexBinaryHNSW*>(index)->hnsw.efSearch = ef;
+}
+
+int faiss_IndexBinaryHNSW_efConstruction(const FaissIndexBinaryHNSW* index) {
+    return reinterpret_cast<const IndexBinaryHNSW*>(index)->hnsw.efConstruction;
+}
+
+void faiss_IndexBinaryHNSW_set_efConstruction(
+        FaissIndexBinaryHNSW* index,
+        int ef) {
+    reinterpret_cast<IndexBinaryHNSW*>(index)->hnsw.efConstruction = ef;
+}
+}
@@ -0,0 +1,39 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ *
+ * This source code is licensed under the MIT license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+// Copyright 2004-present Facebook. All Rights Reserved.
+// -*- c++ -*-
+
+#ifndef FAISS_INDEX_BINARY_HNSW_C_H
+#define FAISS_INDEX_BINARY_HNSW_C_H
+
+#include "IndexBinary_c.h"
+#include "faiss_c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+FAISS_DECLARE_CLASS_INHERITED(IndexBinaryHNSW, IndexBinary)
+FAISS_DECLARE_INDEX_BINARY_DOWNCAST(IndexBinaryHNSW)
+FAISS_DECLARE_DESTRUCTOR(IndexBinaryHNSW)
+
+/// expansion factor at search time, the search uses max(efSearch, k)
+int faiss_IndexBinaryHNSW_efSearch(const FaissIndexBinaryHNSW* index);
+void faiss_IndexBinaryHNSW_set_efSearch(FaissIndexBinaryHNSW* index, int ef);
+
+/// expansion factor at construction time
+int faiss_IndexBinaryHNSW_efConstruction(const FaissIndexBinaryHNSW* index);
+void faiss_IndexBinaryHNSW_set_efConstruction(
+        FaissIndexBinaryHNSW* index,
+        int ef);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -9,9 +9,42 @@
 // -*- c++ -*-
 
 #include "IndexBinaryIVF_c.h"
+#include <faiss/IndexBinaryFlat.h>
+#include <faiss/IndexBinaryHNSW.h>
 #include <faiss/IndexBinaryIVF.h>
+#include <faiss/impl/FaissAssert.h>
+#include <faiss/Index.h>
+#include <faiss/invlists/InvertedLists.h>
+#include <faiss/invlists/OnDiskInvertedLists.h>
+#include <algorithm>
+#include <vector>
 #include "macros_impl.h"
 
+namespace {
+
+/// Read one byte of every page, so that the memory is resident before it is used
+size_t touch(const void* data, size_t bytes) {
+    auto p = static_cast<const volatile uint8_t*>(data);
+    uint8_t sum = 0;
+    for (size_t i = 0; i < bytes; i += 4096) {
+        sum += p[i];
+    }
+    (void)sum;
+    return bytes;
+}
+
+template <typename V>
+size_t touch_vector(const V& v) {
+    return touch(v.data(), v.size() * sizeof(*v.data()));
+}
+
+size_t touch_flat(const faiss::IndexBinary* index) {
+    auto flat = dynamic_cast<const faiss::IndexBinaryFlat*>(index);
+    return flat ? touch_vector(flat->xb) : 0;
+}
+
+} // namespace
+
 extern "C" {
 
 using faiss::IndexBinaryIVF;
@@ -52,4 +85,145 @@ void faiss_IndexBinaryIVF_set_cp(
 }
 /// index used during clustering
 DEFINE_GETTER_PERMISSIVE(IndexBinaryIVF, FaissIndex*, clustering_index)
+void faiss_IndexBinaryIVF_set_clustering_index(
+        FaissIndexBinaryIVF* index,
+        FaissIndex* clustering_index) {
+    reinterpret_cast<IndexBinaryIVF*>(index)->clustering_index =
+            reinterpret_cast<faiss::Index*>(clustering_index);
+}
+
+int faiss_IndexBinaryIVF_get_list(
+        const FaissIndexBinaryIVF* index,
+        size_t list_no,
+        size_t* size,
+        const uint8_t** codes,
+        const idx_t** ids) {
+    try {
+        auto invlists =
+                reinterpret_cast<const IndexBinaryIVF*>(index)->invlists;
+        *size = invlists->list_size(list_no);
+        *codes = invlists->get_codes(list_no);
+        *ids = invlists->get_ids(list_no);
+    }
+    CATCH_AND_HANDLE
+}
+
+int faiss_IndexBinaryIVF_search_nprobe(
+        const FaissIndexBinaryIVF* index,
+        idx_t n,
+        const uint8_t* x,
+        idx_t k,
+        size_t nprobe,
+        int32_t* distances,
+        idx_t* labels) {
+    try {
+        auto ivf = reinterpret_cast<const IndexBinaryIVF*>(index);
+        nprobe = std::min(nprobe, ivf->nlist);
+        FAISS_THROW_IF_NOT_MSG(nprobe > 0, "nprobe must be positive");
+
+        // same as IndexBinaryIVF::search, with the parameters of this call
+        std::vector<idx_t> assign(n * nprobe);
+        std::vector<int32_t> coarse_dis(n * nprobe);
+        ivf->quantizer->search(n, x, nprobe, coarse_dis.data(), assign.data());
+        ivf->invlists->prefetch_lists(assign.data(), n * nprobe);
+
+#if FAISS_VERSION_MAJOR > 1 || \
+        (FAISS_VERSION_MAJOR == 1 && \
+         (FAISS_VERSION_MINOR > 7 || \
+          (FAISS_VERSION_MINOR == 7 && FAISS_VERSION_PATCH >= 3)))
+        faiss::SearchParametersIVF params;
+#else
+        faiss::IVFSearchParameters params;
+#endif
+        params.nprobe = nprobe;
+        params.max_codes = ivf->max_codes;
+        ivf->search_preassigned(
+                n,
+                x,
+                k,
+                assign.data(),
+                coarse_dis.data(),
+                distances,
+                labels,
+                false,
+                &params);
+    }
+    CATCH_AND_HANDLE
+}
+
+int faiss_IndexBinaryIVF_merge_from(
+        FaissIndexBinaryIVF* index,
+        FaissIndexBinaryIVF* other,
+        idx_t add_id) {
+    try {
+        reinterpret_cast<IndexBinaryIVF*>(index)->merge_from(
+                *reinterpret_cast<IndexBinaryIVF*>(other), add_id);
+    }
+    CATCH_AND_HANDLE
+}
+
+int faiss_IndexBinaryIVF_merge_ondisk(
+        FaissIndexBinaryIVF* index,
+        const FaissIndexBinaryIVF** shards,
+        size_t n,
+        const char* filename) {
+    try {
+        auto ivf = reinterpret_cast<IndexBinaryIVF*>(index);
+        std::vector<const faiss::InvertedLists*> invlists;
+        idx_t ntotal = 0;
+        for (size_t i = 0; i < n; i++) {
+            auto shard = reinterpret_cast<const IndexBinaryIVF*>(shards[i]);
+            FAISS_THROW_IF_NOT_MSG(
+                    shard->nlist == ivf->nlist &&
+                            shard->code_size == ivf->code_size,
+                    "shards have different quantizers");
+            invlists.push_back(shard->invlists);
+            ntotal += shard->ntotal;
+        }
+
+        auto ondisk = new faiss::OnDiskInvertedLists(
+                ivf->nlist, ivf->code_size, filename);
+#if FAISS_VERSION_MAJOR > 1 || \
+        (FAISS_VERSION_MAJOR == 1 && \
+         (FAISS_VERSION_MINOR > 7 || \
+          (FAISS_VERSION_MINOR == 7 && FAISS_VERSION_PATCH >= 3)))
+        ondisk->merge_from_multiple(invlists.data(), invlists.size());
+#else
+        ondisk->merge_from(invlists.data(), invlists.size());
+#endif
+        ivf->replace_invlists(ondisk, true);
+        ivf->ntotal = ntotal;
+    }
+    CATCH_AND_HANDLE
+}
+
+int faiss_IndexBinaryIVF_clear_invlists(FaissIndexBinaryIVF* index) {
+    try {
+        auto ivf = reinterpret_cast<IndexBinaryIVF*>(index);
+        ivf->replace_invlists(
+                new faiss::ArrayInvertedLists(ivf->nlist, ivf->code_size),
+                true);
+        ivf->ntotal = 0;
+    }
+    CATCH_AND_HANDLE
+}
+
+int faiss_IndexBinaryIVF_prefetch_quantizer(
+        const FaissIndexBinaryIVF* index,
+        size_t* bytes) {
+    try {
+        auto quantizer =
+                reinterpret_cast<const IndexBinaryIVF*>(index)->quantizer;
+        size_t total = touch_flat(quantizer);
+        auto hnsw = dynamic_cast<const faiss::IndexBinaryHNSW*>(quantizer);
+        if (hnsw) {
+            total += touch_flat(hnsw->storage);
+            total += touch_vector(hnsw->hnsw.neighbors);
+            total += touch_vector(hnsw->hnsw.offsets);
+            total += touch_vector(hnsw->hnsw.levels);
+        }
+        *bytes = total;
+    }
+    CATCH_AND_HANDLE
+}
 }
@@ -63,6 +63,81 @@ FAISS_DECLARE_GETTER(IndexBinaryIVF, ClusteringParameters, cp)
 /// index used during clustering
 FAISS_DECLARE_GETTER_SETTER(IndexBinaryIVF, FaissIndex*, clustering_index)
 
+/** Get the content of an inverted list, the pointers stay valid until the
+ * index is modified. With IO_FLAG_MMAP they point into the mapped file.
+ *
+ * @param list_no  inverted list number
+ * @param size     output number of vectors in the list
+ * @param codes    output codes of the vectors, size * code_size bytes
+ * @param ids      output ids of the vectors, size elements
+ */
+int faiss_IndexBinaryIVF_get_list(
+        const FaissIndexBinaryIVF* index,
+        size_t list_no,
+        size_t* size,
+        const uint8_t** codes,
+        const idx_t** ids);
+
+/** Search with nprobe given for this call, the nprobe of the index is unchanged,
+ * so several searches with different nprobe can run at the same time.
+ *
+ * @param nprobe     number of inverted lists probed for each query, at most nlist
+ * @param distances  output distances, n * k elements
+ * @param labels     output labels, n * k elements
+ */
+int faiss_IndexBinaryIVF_search_nprobe(
+        const FaissIndexBinaryIVF* index,
+        idx_t n,
+        const uint8_t* x,
+        idx_t k,
+        size_t nprobe,
+        int32_t* distances,
+        idx_t* labels);
+
+/** Move all vectors of other into index, other is left empty.
+ *
+ * Both indexes must share the same quantizer. The inverted lists of other
+ * must be writable, so it can't be read with IO_FLAG_MMAP.
+ *
+ * @param add_id  added to the ids of other
+ */
+int faiss_IndexBinaryIVF_merge_from(
+        FaissIndexBinaryIVF* index,
+        FaissIndexBinaryIVF* other,
+        idx_t add_id);
+
+/** Replace the inverted lists of index with on-disk inverted lists holding
+ * the vectors of all shards, which may include index itself.
+ *
+ * Lists are copied one by one, so the shards can be read with IO_FLAG_MMAP
+ * and the merge needs little memory.
+ *
+ * @param shards    indexes sharing the quantizer of index
+ * @param n         number of shards
+ * @param filename  file of the inverted lists, referenced by the index file
+ */
+int faiss_IndexBinaryIVF_merge_ondisk(
+        FaissIndexBinaryIVF* index,
+        const FaissIndexBinaryIVF** shards,
+        size_t n,
+        const char* filename);
+
+/** Replace the inverted lists of index with empty lists held in memory.
+ *
+ * The quantizer is kept, so this gives an empty index to add to, also when
+ * the lists were read with IO_FLAG_MMAP and can't be reset.
+ */
+int faiss_IndexBinaryIVF_clear_invlists(FaissIndexBinaryIVF* index);
+
+/** Read every page of the quantizer: the centroids of a flat quantizer, or
+ * the centroids and the graph of an HNSW quantizer.
+ *
+ * @param bytes  output size of the quantizer in bytes
+ */
+int faiss_IndexBinaryIVF_prefetch_quantizer(
+        const FaissIndexBinaryIVF* index,
+        size_t* bytes);
+
 #ifdef __cplusplus
 }
 #endif
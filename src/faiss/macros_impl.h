@@ -102,7 +102,7 @@
 #define DEFINE_INDEX_BINARY_DOWNCAST(clazz)                                        \
     Faiss##clazz* faiss_##clazz##_cast(FaissIndexBinary* index) {                 \
         return reinterpret_cast<Faiss##clazz*>(dynamic_cast<faiss::clazz*>( \
-                reinterpret_cast<faiss::Index*>(index)));                   \
+                reinterpret_cast<faiss::IndexBinary*>(index)));             \
     }
 
 #endif
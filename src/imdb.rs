@@ -1,29 +1,99 @@
 use std::collections::HashMap;
-use std::os::unix::ffi::OsStrExt;
-use std::time::Instant;
+use std::ffi::OsStr;
+use std::path::{Path, PathBuf};
+use std::str::FromStr;
+use std::sync::{mpsc, Mutex};
+use std::time::{Instant, SystemTime, UNIX_EPOCH};
 
 use crate::config::ConfDir;
-use crate::db::ImageDB;
-use crate::index::{FaissIndex, MultiFaissIndex};
-use crate::matrix::{Matrix, Matrix2D};
+use crate::db::{ImageDB, ImageIdTable};
+use crate::index::{
+    ClusteringIndex, FaissIndex, ListHits, MultiFaissIndex, Neighbor, SearchBuffer,
+};
+use crate::matrix::{Matrix, Matrix2D, MatrixView};
+use crate::metrics::METRICS;
 use crate::slam3_orb::Slam3ORB;
 use crate::utils;
-use crate::utils::{hash_file, wilson_score};
-use anyhow::Result;
+use crate::utils::{
+    hash_data, hash_file, top_wilson_scores, NpyWriter, ScoreAccumulator, SplitMix64,
+};
+use anyhow::{anyhow, bail, Result};
+use crossbeam_utils::thread::ScopedJoinHandle;
 use itertools::Itertools;
 use log::{debug, info};
-use ndarray::prelude::*;
+use once_cell::sync::OnceCell;
+use opencv::prelude::*;
+use opencv::types;
+use rayon::prelude::*;
 use walkdir::WalkDir;
 
+/// Default training samples per bucket, the most faiss uses (`max_points_per_centroid`)
+const TRAIN_SAMPLES_PER_LIST: usize = 256;
+/// The least faiss trains each bucket with without warning (`min_points_per_centroid`)
+const MIN_TRAIN_SAMPLES_PER_LIST: usize = 39;
+/// Default ceiling of the training samples, 10M features are 320MB
+const MAX_TRAIN_SAMPLES: usize = 10_000_000;
+
+/// One stage of `IMDB::adaptive_search_des`, parsed from `NPROBE:FEATURES`
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct AdaptiveStage {
+    pub nprobe: usize,
+    /// Number of the strongest descriptors searched
+    pub features: usize,
+}
+
+impl FromStr for AdaptiveStage {
+    type Err = String;
+
+    fn from_str(s: &str) -> Result<Self, String> {
+        let parse = |n: &str| n.trim().parse::<usize>().ok().filter(|&n| n > 0);
+        let mut parts = s.splitn(2, ':');
+        match (parts.next().and_then(parse), parts.next().and_then(parse)) {
+            (Some(nprobe), Some(features)) => Ok(Self { nprobe, features }),
+            _ => Err(format!("expect NPROBE:FEATURES, got {}", s)),
+        }
+    }
+}
+
 pub struct IMDB {
     conf_dir: ConfDir,
     db: ImageDB,
+    image_id_table: OnceCell<ImageIdTable>,
+    search_buffers: Mutex<Vec<SearchBuffer>>,
 }
 
 impl IMDB {
+    /// Maximum number of hashes checked in one multi_get when adding images
+    const DEDUP_BATCH: usize = 256;
+
     pub fn new(conf_dir: ConfDir, read_only: bool) -> Result<Self> {
         let db = ImageDB::open(&conf_dir, read_only)?;
-        Ok(Self { db, conf_dir })
+        Ok(Self {
+            db,
+            conf_dir,
+            image_id_table: OnceCell::new(),
+            search_buffers: Mutex::new(vec![]),
+        })
+    }
+
+    /// Return the feature id to image id table, it is rebuilt if images were added since it was written
+    pub fn image_id_table(&self) -> Result<&ImageIdTable> {
+        self.image_id_table.get_or_try_init(|| {
+            // the feature store keeps its own table up to date
+            if let Some(path) = self.db.image_id_table_path() {
+                return ImageIdTable::open(path);
+            }
+            let path = self.conf_dir.image_id_table();
+            if path.exists() {
+                let table = ImageIdTable::open(&path)?;
+                if table.len() as u64 == self.db.total_features() {
+                    return Ok(table);
+                }
+            }
+            info!("building image id table");
+            ImageIdTable::write(&path, &self.db.image_ids())?;
+            ImageIdTable::open(&path)
+        })
     }
 
     pub fn add_image<S: AsRef<str>>(&self, image_path: S, orb: &mut Slam3ORB) -> Result<bool> {
@@ -36,13 +106,331 @@ impl IMDB {
         let image = utils::imread(image_path.as_ref())?;
         let (_, descriptors) = utils::detect_and_compute(orb, &image)?;
 
-        self.db
-            .add_image(image_path.as_ref(), hash.as_bytes(), descriptors)
+        let added = self
+            .db
+            .add_image(image_path.as_ref(), hash.as_bytes(), descriptors)?;
+        // a single image, so its features are flushed right away
+        self.db.sync()?;
+        Ok(added)
+    }
+
+    /// Add a batch of images, descriptors of all new images are computed in a single call
+    ///
+    /// All new images are written in one batch, or ingested as SST files if `ingest` is set.
+    /// Return the result of each image, in the same order as `image_paths`
+    pub fn add_images<S: AsRef<str> + Sync>(
+        &self,
+        image_paths: &[S],
+        orb: &mut Slam3ORB,
+        ingest: bool,
+    ) -> Result<Vec<Result<bool>>> {
+        let decoded = image_paths
+            .par_iter()
+            .map(|image_path| -> Result<Option<(blake3::Hash, Mat)>> {
+                match self.read_new_image(image_path.as_ref())? {
+                    Some((hash, data)) => Ok(Some((hash, utils::imdecode(&data)?))),
+                    None => Ok(None),
+                }
+            })
+            .collect::<Vec<_>>();
+
+        let mut results = Vec::with_capacity(image_paths.len());
+        let mut pending = vec![];
+        let mut images = types::VectorOfMat::new();
+        for (i, item) in decoded.into_iter().enumerate() {
+            match item {
+                Ok(Some((hash, image))) => {
+                    pending.push((image_paths[i].as_ref(), hash));
+                    images.push(image);
+                    results.push(Ok(true));
+                }
+                Ok(None) => results.push(Ok(false)),
+                Err(e) => results.push(Err(e)),
+            }
+        }
+        if pending.is_empty() {
+            return Ok(results);
+        }
+
+        let (descriptors, offsets) = utils::detect_and_compute_batch(orb, &images)?;
+        let added = self.write_extracted(&pending, &descriptors, &offsets, ingest)?;
+        // a single batch, so it is ingested right away
+        self.db.sync()?;
+        let indices = results
+            .iter()
+            .enumerate()
+            .filter(|(_, result)| matches!(result, Ok(true)))
+            .map(|(i, _)| i)
+            .collect::<Vec<_>>();
+        for (i, added) in indices.into_iter().zip(added) {
+            results[i] = Ok(added);
+        }
+
+        Ok(results)
+    }
+
+    /// Add images through five stages connected by bounded queues
+    ///
+    /// `read_threads` threads read and hash files, one thread checks the hashes against the
+    /// database in batches, `decode_threads` threads decode new images, this thread extracts the
+    /// features of `chunk_size` images at once, and another thread writes them to the database.
+    /// Every stage works on different images at the same time, and at most a few chunks of images
+    /// are held in memory. `report` is called from any stage with the result of every image
+    pub fn add_images_pipelined<I, F>(
+        &self,
+        image_paths: I,
+        orb: &mut Slam3ORB,
+        chunk_size: usize,
+        read_threads: usize,
+        decode_threads: usize,
+        ingest: bool,
+        report: F,
+    ) -> Result<()>
+    where
+        I: Iterator<Item = String> + Send,
+        F: Fn(&str, Result<bool>) + Sync,
+    {
+        let chunk_size = chunk_size.max(1);
+        let image_paths = &Mutex::new(image_paths);
+        let report = &report;
+
+        crossbeam_utils::thread::scope(|s| -> Result<()> {
+            let (read_tx, read_rx) = mpsc::sync_channel(read_threads.max(1) * 4);
+            let (new_tx, new_rx) = mpsc::sync_channel(read_threads.max(1) * 2);
+            let (decode_tx, decode_rx) = mpsc::sync_channel(chunk_size);
+            let (write_tx, write_rx) = mpsc::sync_channel::<(Vec<(String, blake3::Hash)>, _, _)>(1);
+
+            for _ in 0..read_threads.max(1) {
+                let read_tx = read_tx.clone();
+                s.spawn(move |_| loop {
+                    let image_path = match image_paths.lock().unwrap().next() {
+                        Some(image_path) => image_path,
+                        None => break,
+                    };
+                    match std::fs::read(&image_path) {
+                        Ok(data) => {
+                            let hash = hash_data(&data);
+                            if read_tx.send((image_path, hash, data)).is_err() {
+                                break;
+                            }
+                        }
+                        Err(e) => report(&image_path, Err(e.into())),
+                    }
+                });
+            }
+            drop(read_tx);
+
+            // images already in the database only get their path updated, and are never decoded
+            s.spawn(move |_| {
+                while let Ok(first) = read_rx.recv() {
+                    let mut batch = vec![first];
+                    while batch.len() < Self::DEDUP_BATCH {
+                        match read_rx.try_recv() {
+                            Ok(item) => batch.push(item),
+                            Err(_) => break,
+                        }
+                    }
+                    let hashes = batch
+                        .iter()
+                        .map(|(_, hash, _)| &hash.as_bytes()[..])
+                        .collect::<Vec<_>>();
+                    let ids = match self.db.find_image_ids_by_hashes(&hashes) {
+                        Ok(ids) => ids,
+                        Err(e) => {
+                            for (image_path, _, _) in batch.iter() {
+                                report(image_path, Err(anyhow!("{}", e)));
+                            }
+                            continue;
+                        }
+                    };
+
+                    let mut updates = vec![];
+                    for (item, id) in batch.into_iter().zip(ids) {
+                        match id {
+                            Some(id) => updates.push((id, item.0)),
+                            None => {
+                                if new_tx.send(item).is_err() {
+                                    return;
+                                }
+                            }
+                        }
+                    }
+                    let result = self.db.update_image_paths(&updates);
+                    for (_, image_path) in updates.iter() {
+                        match &result {
+                            Ok(()) => report(image_path, Ok(false)),
+                            Err(e) => report(image_path, Err(anyhow!("{}", e))),
+                        }
+                    }
+                }
+            });
+
+            let new_rx = &Mutex::new(new_rx);
+            for _ in 0..decode_threads.max(1) {
+                let decode_tx = decode_tx.clone();
+                s.spawn(move |_| loop {
+                    let item = new_rx.lock().unwrap().recv();
+                    let (image_path, hash, data): (String, blake3::Hash, Vec<u8>) = match item {
+                        Ok(item) => item,
+                        Err(_) => break,
+                    };
+                    match utils::imdecode(&data) {
+                        Ok(image) => {
+                            if decode_tx.send((image_path, hash, image)).is_err() {
+                                break;
+                            }
+                        }
+                        Err(e) => report(&image_path, Err(e)),
+                    }
+                });
+            }
+            drop(decode_tx);
+
+            let writer = s.spawn(move |_| {
+                for (images, descriptors, offsets) in write_rx {
+                    let images: Vec<(String, blake3::Hash)> = images;
+                    match self.write_extracted(&images, &descriptors, &offsets, ingest) {
+                        Ok(added) => {
+                            for ((image_path, _), added) in images.iter().zip(added) {
+                                report(image_path, Ok(added));
+                            }
+                        }
+                        Err(e) => {
+                            for (image_path, _) in images.iter() {
+                                report(image_path, Err(anyhow!("{}", e)));
+                            }
+                        }
+                    }
+                }
+            });
+
+            let mut images = vec![];
+            let mut mats = types::VectorOfMat::new();
+            let mut decoded = decode_rx.into_iter();
+            loop {
+                let item = decoded.next();
+                let done = item.is_none();
+                if let Some((image_path, hash, image)) = item {
+                    images.push((image_path, hash));
+                    mats.push(image);
+                }
+                if images.len() == chunk_size || (done && !images.is_empty()) {
+                    match utils::detect_and_compute_batch(orb, &mats) {
+                        Ok((descriptors, offsets)) => {
+                            let batch = (std::mem::take(&mut images), descriptors, offsets);
+                            if write_tx.send(batch).is_err() {
+                                break;
+                            }
+                        }
+                        Err(e) => {
+                            for (image_path, _) in images.drain(..) {
+                                report(&image_path, Err(anyhow!("{}", e)));
+                            }
+                        }
+                    }
+                    mats.clear();
+                }
+                if done {
+                    break;
+                }
+            }
+            drop(write_tx);
+
+            writer.join().expect("writer thread panicked");
+            // ingest what is still buffered
+            self.db.sync()
+        })
+        .expect("add images thread panicked")
+    }
+
+    /// Read and hash an image file
+    ///
+    /// Return None if the image is already in the database, its path is updated instead
+    fn read_new_image(&self, image_path: &str) -> Result<Option<(blake3::Hash, Vec<u8>)>> {
+        let data = std::fs::read(image_path)?;
+        let hash = hash_data(&data);
+        if let Some(id) = self.db.find_image_id_by_hash(hash.as_bytes())? {
+            self.db.update_image_path(id, image_path)?;
+            return Ok(None);
+        }
+        Ok(Some((hash, data)))
     }
 
-    pub fn train_index(&mut self) {
-        let mut _index = self.get_index(false);
-        todo!()
+    /// Write images with the descriptors from `detect_and_compute_batch`
+    fn write_extracted<S: AsRef<str>>(
+        &self,
+        images: &[(S, blake3::Hash)],
+        descriptors: &Mat,
+        offsets: &[usize],
+        ingest: bool,
+    ) -> Result<Vec<bool>> {
+        let data = match offsets.last() {
+            Some(&0) => &[][..],
+            _ => descriptors.data_typed::<u8>()?,
+        };
+
+        let new_images = images
+            .iter()
+            .enumerate()
+            .map(|(n, (image_path, hash))| {
+                let features = MatrixView::new(32, &data[offsets[n] * 32..offsets[n + 1] * 32]);
+                (image_path.as_ref(), &hash.as_bytes()[..], features)
+            })
+            .collect::<Vec<_>>();
+        match ingest {
+            true => self.db.ingest_images(&new_images),
+            false => self.db.add_images(&new_images),
+        }
+    }
+
+    /// Train a new index on a uniform sample of at most `samples` features
+    ///
+    /// Features are reservoir sampled while they are read from the database, so memory is bounded
+    /// by the sample instead of the whole dataset
+    pub fn train_index(
+        &self,
+        description: Option<&str>,
+        samples: Option<usize>,
+        clustering_index: Option<&str>,
+        seed: u64,
+    ) -> Result<()> {
+        let index_file = self.conf_dir.index();
+        let mut index = match description {
+            Some(description) if !index_file.exists() => FaissIndex::new(256, description),
+            _ => self.get_index(false),
+        };
+        if index.is_trained() {
+            bail!(
+                "index is already trained, remove {} to train again",
+                index_file.display()
+            );
+        }
+
+        // 256 per bucket is a lot of memory on large indexes (8GB for 1M buckets), so the default
+        // is capped at MAX_TRAIN_SAMPLES, but never below what faiss needs per bucket
+        let nlist = index.nlist();
+        let samples = samples.unwrap_or_else(|| {
+            (TRAIN_SAMPLES_PER_LIST * nlist)
+                .min(MAX_TRAIN_SAMPLES)
+                .max(MIN_TRAIN_SAMPLES_PER_LIST * nlist)
+        });
+        let features = self.db.features(true).chain(self.db.features(false));
+        let sample =
+            utils::reservoir_sample(features.map(|(_, feature)| feature), 32, samples, seed);
+        info!("training index with {} features", sample.height());
+
+        let start = Instant::now();
+        match clustering_index {
+            Some(description) => {
+                let clustering = ClusteringIndex::new(256, description);
+                index.train_with_clustering(&sample, &clustering);
+            }
+            None => index.train(&sample),
+        }
+        info!("trained in {:.2}s", start.elapsed().as_secs_f32());
+
+        index.write_file(&*index_file.to_string_lossy());
+        Ok(())
     }
 
     pub fn build_index(
@@ -50,72 +438,205 @@ impl IMDB {
         chunk_size: usize,
         start: Option<u64>,
         end: Option<u64>,
+        segment: bool,
     ) -> Result<()> {
-        let mut index = self.get_index(false);
-        let mut features = FeatureWithId::new();
+        // in segment mode, the features of this run go to one new segment file, which only holds
+        // them and the quantizer, so only the quantizer of the existing index is read
+        let index_file = self.conf_dir.index();
+        let mut index = match segment && index_file.exists() {
+            true => FaissIndex::empty_from_file(&*index_file.to_string_lossy()),
+            false => self.get_index(false),
+        };
 
         if !index.is_trained() {
             panic!("index hasn't been trained");
         }
+        let target = match segment {
+            true => self.next_segment(),
+            false => index_file,
+        };
+        let target = &target;
 
         let mut tmp_file = self.conf_dir.index();
         tmp_file.set_extension(".tmp");
+        let tmp_file = &tmp_file;
+
+        // Three stages run at the same time: a reader thread fills chunks from RocksDB, this thread
+        // adds the previous chunk to the index, and a checkpoint thread marks the chunk before it as
+        // indexed. Two chunk buffers are passed around, so nothing is allocated after the first chunks.
+        crossbeam_utils::thread::scope(|s| -> Result<()> {
+            let (full_tx, full_rx) = mpsc::sync_channel::<FeatureWithId>(1);
+            let (free_tx, free_rx) = mpsc::channel();
+            for _ in 0..2 {
+                free_tx.send(FeatureWithId::with_capacity(chunk_size))?;
+            }
 
-        let add_index = |index: &mut FaissIndex, features: &FeatureWithId| -> Result<()> {
-            index.add_with_ids(features.features(), features.ids());
-            index.write_file(&*tmp_file.to_str().unwrap());
-            self.db.mark_as_indexed(&features.ids_u64())?;
-            std::fs::rename(&tmp_file, self.conf_dir.index())?;
-            Ok(())
-        };
+            s.spawn(move |_| {
+                let mut features = match free_rx.recv() {
+                    Ok(features) => features,
+                    Err(_) => return,
+                };
+                // TODO: 丢弃迭代器以允许 RocksDB 从硬盘上删除不需要的数据
+                for (id, feature) in self.db.features(false) {
+                    if start.is_some() && id < start.unwrap() {
+                        continue;
+                    }
+                    if end.is_some() && id >= end.unwrap() {
+                        continue;
+                    }
+                    features.add(id as i64, &*feature);
+                    if features.len() == chunk_size {
+                        if full_tx.send(features).is_err() {
+                            return;
+                        }
+                        features = match free_rx.recv() {
+                            Ok(features) => features,
+                            Err(_) => return,
+                        };
+                    }
+                }
+                if features.len() != 0 {
+                    let _ = full_tx.send(features);
+                }
+            });
+
+            let mut checkpoint = None;
+            for mut features in full_rx {
+                info!("Building index: {} + {}", index.ntotal(), features.len());
+                index.add_with_ids(features.features(), features.ids());
+
+                // the tmp file can only be reused once the previous checkpoint is renamed
+                if let Some(handle) = checkpoint.take() {
+                    join_checkpoint(handle)?;
+                }
+                index.write_file(&*tmp_file.to_str().unwrap());
+
+                // the features are kept, so they don't have to be read again from NewFeature
+                let ids = features.ids_u64();
+                let mut moved = Matrix2D::with_capacity(features.features().width(), ids.len());
+                for line in features.features().iter_lines() {
+                    moved.push(line);
+                }
+                checkpoint = Some(s.spawn(move |_| -> Result<()> {
+                    self.db
+                        .move_to_indexed(ids.iter().copied().zip(moved.iter_lines()))?;
+                    std::fs::rename(tmp_file, target)?;
+                    Ok(())
+                }));
 
-        // TODO: 丢弃迭代器以允许 RocksDB 从硬盘上删除不需要的数据
-        for (id, feature) in self.db.features(false) {
-            if start.is_some() && id < start.unwrap() {
-                continue;
-            }
-            if end.is_some() && id >= end.unwrap() {
-                continue;
-            }
-            features.add(id as i64, &*feature);
-            if features.len() == chunk_size {
-                info!("Building index: {} + {}", index.ntotal(), chunk_size);
-                add_index(&mut index, &features)?;
                 features.clear();
+                let _ = free_tx.send(features);
             }
-        }
 
-        if !features.len() != 0 {
+            if let Some(handle) = checkpoint.take() {
+                join_checkpoint(handle)?;
+            }
             info!("Building index: END");
-            add_index(&mut index, &features)?;
-        }
-
-        Ok(())
+            Ok(())
+        })
+        .expect("build thread panicked")
     }
 
-    pub fn mark_as_indexed(&self, max_feature_id: u64, chunk_size: usize) -> Result<()> {
-        let mut idx = vec![];
+    /// Merge the main index and all segments into the main index
+    ///
+    /// Segments are moved into the first index one at a time, so only the result and one segment
+    /// are in memory. With `on_disk`, every file is read with mmap and the inverted lists are
+    /// copied list by list into a new `.ivfdata` file referenced by the index, which needs little
+    /// memory. All files must share the quantizer of the main index.
+    pub fn merge_index(&self, on_disk: bool) -> Result<()> {
+        let mut paths = self.index_files();
+        // the main index sorts before its segments
+        paths.sort();
+        if paths.is_empty() {
+            bail!("no index file found");
+        }
+        if paths.len() == 1 && !on_disk {
+            info!("nothing to merge");
+            return Ok(());
+        }
 
-        for (id, _) in self.db.features(false) {
-            if id >= max_feature_id {
-                continue;
+        let open = |path: &Path| FaissIndex::from_file(&*path.to_string_lossy(), on_disk);
+        let mut index = open(&paths[0]);
+        let check = |index: &FaissIndex, other: &FaissIndex, path: &Path| -> Result<()> {
+            if !index.same_quantizer(other) {
+                bail!(
+                    "{} and {} have different quantizers",
+                    paths[0].display(),
+                    path.display()
+                );
             }
-            idx.push(id);
-            if idx.len() == chunk_size {
-                info!("mark as indexed: {}", chunk_size);
-                self.db.mark_as_indexed(&idx)?;
-                idx.clear();
+            Ok(())
+        };
+
+        let mut data_file = None;
+        if on_disk {
+            let others = paths[1..].iter().map(|path| open(path)).collect::<Vec<_>>();
+            for (other, path) in others.iter().zip(paths[1..].iter()) {
+                check(&index, other, path)?;
+            }
+            let secs = SystemTime::now().duration_since(UNIX_EPOCH)?.as_secs();
+            // the index file refers to the lists by this path, so it must be absolute
+            let file = self.conf_dir.ivfdata(secs);
+            let path = std::fs::canonicalize(self.conf_dir.path())?.join(file.file_name().unwrap());
+            info!(
+                "merging {} index files into {}",
+                paths.len(),
+                path.display()
+            );
+            index.merge_ondisk(&others, &*path.to_string_lossy());
+            data_file = Some(path);
+        } else {
+            for path in paths[1..].iter() {
+                let mut other = open(path);
+                check(&index, &other, path)?;
+                info!(
+                    "merging {}: {} + {}",
+                    path.display(),
+                    index.ntotal(),
+                    other.ntotal()
+                );
+                index.merge_from(&mut other);
             }
         }
 
-        if !idx.is_empty() {
-            info!("mark as indexed: {}", idx.len());
-            self.db.mark_as_indexed(&idx)?;
+        let mut tmp_file = self.conf_dir.index();
+        tmp_file.set_extension("merge");
+        index.write_file(&*tmp_file.to_string_lossy());
+        std::fs::rename(&tmp_file, self.conf_dir.index())?;
+        info!("merged index: {} features", index.ntotal());
+
+        // the merged index is searched with the statistics of all its shards
+        let hits_dir = self.conf_dir.list_hits();
+        if hits_dir.exists() {
+            let hits = ListHits::new(index.nlist());
+            for path in paths.iter() {
+                let file = hits_dir.join(path.file_name().unwrap());
+                hits.add_from(&ListHits::load(&file, index.nlist()));
+            }
+            hits.save(hits_dir.join("index"))?;
         }
 
+        for path in paths.iter().filter(|&path| *path != self.conf_dir.index()) {
+            std::fs::remove_file(path)?;
+            let _ = std::fs::remove_file(hits_dir.join(path.file_name().unwrap()));
+        }
+        // lists of an index merged before are now in the new file
+        if let Some(data_file) = data_file {
+            for entry in std::fs::read_dir(self.conf_dir.path())? {
+                let path = entry?.path();
+                let stale = path.file_name() != data_file.file_name();
+                if path.extension() == Some(OsStr::new("ivfdata")) && stale {
+                    std::fs::remove_file(&path)?;
+                }
+            }
+        }
         Ok(())
     }
 
+    pub fn mark_as_indexed(&self, max_feature_id: u64, chunk_size: usize) -> Result<()> {
+        self.db.mark_range_as_indexed(max_feature_id, chunk_size)
+    }
+
     pub fn clear_cache(&self, unindexed: bool) -> Result<()> {
         self.db.clear_cache(true)?;
         if unindexed {
@@ -124,13 +645,31 @@ impl IMDB {
         Ok(())
     }
 
-    pub fn export(&self) -> Result<Array2<u8>> {
-        let mut arr = Array2::zeros((0, 32));
-        for (_, feature) in self.db.features(false) {
-            let tmp = ArrayView::from(&feature);
-            arr.push(Axis(0), tmp)?;
+    /// Stream unindexed features in [start, end) to a .npy file, keeping each one with a
+    /// probability of `sample_rate`
+    ///
+    /// Only the write buffer is kept in memory. Return the number of exported features
+    pub fn export<P: AsRef<Path>>(
+        &self,
+        path: P,
+        start: Option<u64>,
+        end: Option<u64>,
+        sample_rate: f64,
+        seed: u64,
+    ) -> Result<u64> {
+        let mut writer = NpyWriter::create(path, 32)?;
+        let mut rng = SplitMix64::new(seed);
+        let threshold = (sample_rate.max(0.0).min(1.0) * u64::MAX as f64) as u64;
+        for (id, feature) in self.db.features(false) {
+            if id < start.unwrap_or(0) || id >= end.unwrap_or(u64::MAX) {
+                continue;
+            }
+            if sample_rate < 1.0 && rng.next_u64() > threshold {
+                continue;
+            }
+            writer.push(&feature)?;
         }
-        Ok(arr)
+        writer.finish()
     }
 
     fn create_index(&self) -> FaissIndex {
@@ -143,10 +682,11 @@ impl IMDB {
             }
             // 1M ~ 10M
             1000001..=10000000 => String::from("BIVF65536"),
-            // 10M ~ 100M
-            10000001..=100000000 => String::from("BIVF262144"),
+            // 10M ~ 100M, a brute force scan of this many centroids dominates the search, so they
+            // are searched with an HNSW graph
+            10000001..=100000000 => String::from("BIVF262144_HNSW32"),
             // 100M ~ 10G
-            100000001..=10000000000 => String::from("BIVF1048576"),
+            100000001..=10000000000 => String::from("BIVF1048576_HNSW32"),
             _ => unimplemented!(),
         };
         debug!("creating index with {}", desc);
@@ -154,15 +694,48 @@ impl IMDB {
     }
 
     pub fn get_multi_index(&self, mmap: bool) -> MultiFaissIndex {
+        MultiFaissIndex::from_file(self.index_files(), mmap)
+    }
+
+    /// Return the main index and all segments, temporary files are skipped
+    pub fn index_files(&self) -> Vec<PathBuf> {
         let index_file = &*self.conf_dir.index();
-        let index_files = WalkDir::new(index_file.parent().unwrap())
+        WalkDir::new(index_file.parent().unwrap())
             .max_depth(1)
             .into_iter()
             .filter_map(|entry| entry.ok())
-            .filter(|entry| entry.file_name().as_bytes().starts_with(b"index"))
-            .collect::<Vec<_>>();
-        let index_files = index_files.iter().map(|entry| entry.path());
-        MultiFaissIndex::from_file(index_files, mmap)
+            .filter(|entry| !entry.file_type().is_dir())
+            .filter(|entry| entry.file_name().to_string_lossy().starts_with("index"))
+            .filter(|entry| {
+                // unfinished writes and merges, and on-disk lists referenced by an index
+                let skip = entry.path().extension().map_or(false, |ext| {
+                    ["tmp", "merge", "ivfdata", "hits"]
+                        .iter()
+                        .any(|&skip| ext == skip)
+                });
+                if skip {
+                    debug!("not an index file: {}", entry.path().display());
+                }
+                !skip
+            })
+            .map(|entry| entry.into_path())
+            .collect()
+    }
+
+    /// Return the path of the next unused index segment
+    fn next_segment(&self) -> PathBuf {
+        let index_file = &*self.conf_dir.index();
+        let next = WalkDir::new(index_file.parent().unwrap())
+            .max_depth(1)
+            .into_iter()
+            .filter_map(|entry| entry.ok())
+            .filter_map(|entry| {
+                let name = entry.file_name().to_str()?.to_owned();
+                name.strip_prefix("index-")?.parse::<u32>().ok()
+            })
+            .max()
+            .map_or(0, |n| n + 1);
+        self.conf_dir.segment(next)
     }
 
     pub fn get_index(&self, mmap: bool) -> FaissIndex {
@@ -179,40 +752,179 @@ impl IMDB {
         }
     }
 
+    /// Search the best `limit` images matching the descriptors
     pub fn search_des<M: Matrix>(
         &self,
         index: &MultiFaissIndex,
         descriptors: M,
         knn: usize,
         max_distance: u32,
+        limit: usize,
     ) -> Result<Vec<(f32, String)>> {
         debug!("searching {} nearest neighbors", knn);
         let instant = Instant::now();
-        let mut counter = HashMap::new();
 
-        for neighbors in index.search(&descriptors, knn) {
-            for neighbor in neighbors {
-                if neighbor.distance > max_distance {
-                    continue;
-                }
-                let image_index = self.db.find_image_path(neighbor.index as u64)?;
-                counter
-                    .entry(image_index)
-                    .or_insert_with(Vec::new)
-                    .push(1. - neighbor.distance as f32 / 256.);
+        let mut buffer = self
+            .search_buffers
+            .lock()
+            .unwrap()
+            .pop()
+            .unwrap_or_default();
+        let results = self.score(
+            index.search(&descriptors, knn, &mut buffer).iter(),
+            max_distance,
+            limit,
+        );
+        self.search_buffers.lock().unwrap().push(buffer);
+
+        debug!("search time: {:.2}s", instant.elapsed().as_secs_f32());
+
+        results
+    }
+
+    /// Search in stages of growing nprobe and descriptor count, until the best image is clear
+    ///
+    /// The descriptors must be sorted strongest first, see `utils::sort_by_response`, since each
+    /// stage only searches the first `features` of them. A stage is accepted once the best score
+    /// leads the second by at least `margin`, and the last stage is always accepted
+    pub fn adaptive_search_des<M: Matrix>(
+        &self,
+        index: &MultiFaissIndex,
+        descriptors: M,
+        stages: &[AdaptiveStage],
+        margin: f32,
+        knn: usize,
+        max_distance: u32,
+        limit: usize,
+    ) -> Result<Vec<(f32, String)>> {
+        let instant = Instant::now();
+
+        let mut buffer = self
+            .search_buffers
+            .lock()
+            .unwrap()
+            .pop()
+            .unwrap_or_default();
+        let mut search = |stage: &AdaptiveStage| {
+            let rows = stage.features.min(descriptors.height());
+            // SAFETY: a Matrix is a continuous array of height * width bytes
+            let data = unsafe {
+                std::slice::from_raw_parts(descriptors.as_ptr(), descriptors.width() * rows)
+            };
+            let points = MatrixView::new(descriptors.width(), data);
+            let neighbors = index.search_nprobe(&points, knn, Some(stage.nprobe), &mut buffer);
+            // the second image is needed for the margin
+            self.score(neighbors.iter(), max_distance, limit.max(2))
+        };
+
+        let mut results = Ok(vec![]);
+        for (i, stage) in stages.iter().enumerate() {
+            results = search(stage);
+            let lead = match results.as_deref() {
+                Ok([first, second, ..]) => first.0 - second.0,
+                Ok([first]) => first.0,
+                Ok([]) => 0.,
+                Err(_) => break,
+            };
+            debug!(
+                "adaptive stage {}: nprobe {}, {} features, lead {:.2}",
+                i, stage.nprobe, stage.features, lead
+            );
+            if lead >= margin {
+                break;
+            }
+            if i + 1 < stages.len() {
+                METRICS.adaptive_widened.add(1);
             }
         }
+        self.search_buffers.lock().unwrap().push(buffer);
 
-        let mut results = counter
-            .into_iter()
-            // TODO: score type
-            .map(|(image, scores)| (100. * wilson_score(&*scores), image))
-            .collect::<Vec<_>>();
-        results.sort_unstable_by(|a, b| b.0.partial_cmp(&a.0).unwrap());
+        debug!("search time: {:.2}s", instant.elapsed().as_secs_f32());
+
+        results.map(|mut results| {
+            results.truncate(limit);
+            results
+        })
+    }
+
+    /// Like `search_des`, but match every neighbor within `max_distance` instead of the nearest `knn`
+    pub fn range_search_des<M: Matrix>(
+        &self,
+        index: &MultiFaissIndex,
+        descriptors: M,
+        max_distance: u32,
+        limit: usize,
+    ) -> Result<Vec<(f32, String)>> {
+        debug!("searching neighbors within {}", max_distance);
+        let instant = Instant::now();
+
+        let shards = index.range_search(&descriptors, max_distance);
+        let results = self.score(
+            shards.iter().flat_map(|shard| shard.iter()),
+            max_distance,
+            limit,
+        );
 
         debug!("search time: {:.2}s", instant.elapsed().as_secs_f32());
 
-        Ok(results)
+        results
+    }
+
+    /// Score images by their matched neighbors, and return the best `limit` images
+    pub fn score<I>(
+        &self,
+        neighbors: I,
+        max_distance: u32,
+        limit: usize,
+    ) -> Result<Vec<(f32, String)>>
+    where
+        I: IntoIterator<Item = Neighbor>,
+    {
+        let start = Instant::now();
+        let table = self.image_id_table()?;
+        let mut counter = HashMap::<i32, ScoreAccumulator>::new();
+
+        for neighbor in neighbors {
+            if neighbor.distance > max_distance {
+                continue;
+            }
+            let image_id = match table.get(neighbor.index as u64) {
+                Some(image_id) => image_id as i32,
+                None => match self.db.find_image_id_by_id(neighbor.index as u64)? {
+                    Some(image_id) => image_id,
+                    // left in a stale index file, such as a segment built before clear-cache
+                    None => {
+                        debug!("feature {} not found, skipped", neighbor.index);
+                        continue;
+                    }
+                },
+            };
+            counter
+                .entry(image_id)
+                .or_default()
+                .add(1. - neighbor.distance as f32 / 256.);
+        }
+
+        // TODO: score type
+        let results = top_wilson_scores(counter, limit);
+        METRICS.score.observe_since(start);
+
+        // only paths of the returned images are read from the database, images which are gone are
+        // skipped like their features
+        let start = Instant::now();
+        let results = results
+            .into_iter()
+            .filter_map(|(score, image_id)| match self.db.image_path(image_id) {
+                Ok(Some(path)) => Some(Ok((100. * score, path))),
+                Ok(None) => {
+                    debug!("image {} not found, skipped", image_id);
+                    None
+                }
+                Err(e) => Some(Err(e)),
+            })
+            .collect();
+        METRICS.resolve.observe_since(start);
+        results
     }
 
     pub fn search<S: AsRef<str>>(
@@ -222,11 +934,12 @@ impl IMDB {
         orb: &mut Slam3ORB,
         knn: usize,
         max_distance: u32,
+        limit: usize,
     ) -> Result<Vec<(f32, String)>> {
         let image = utils::imread(image_path.as_ref())?;
         let (_, descriptors) = utils::detect_and_compute(orb, &image)?;
 
-        self.search_des(index, descriptors, knn, max_distance)
+        self.search_des(index, descriptors, knn, max_distance, limit)
     }
 }
 
@@ -234,8 +947,11 @@ impl IMDB {
 struct FeatureWithId(Vec<i64>, Matrix2D);
 
 impl FeatureWithId {
-    pub fn new() -> Self {
-        Self(vec![], Matrix2D::new(32))
+    pub fn with_capacity(capacity: usize) -> Self {
+        Self(
+            Vec::with_capacity(capacity),
+            Matrix2D::with_capacity(32, capacity),
+        )
     }
 
     pub fn add(&mut self, id: i64, feature: &[u8]) {
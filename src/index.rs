@@ -1,10 +1,13 @@
-use crate::matrix::Matrix;
-use itertools::Itertools;
-use log::debug;
-use std::ffi::CString;
+use crate::matrix::{Matrix, MatrixView};
+use crate::metrics::{Histogram, METRICS};
+use log::{debug, info};
+use rayon::prelude::*;
+use std::ffi::{CString, OsString};
+use std::io::Write;
 use std::os::raw::c_char;
-use std::path::Path;
-use std::time::Instant;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Instant, SystemTime};
 
 #[repr(C)]
 #[derive(Debug, Copy, Clone)]
@@ -18,7 +21,35 @@ struct FaissIndexBinaryIVF {
     _unused: [u8; 0],
 }
 
+/// The float `FaissIndex` of the C API
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+struct FaissFloatIndex {
+    _unused: [u8; 0],
+}
+
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+struct FaissIndexBinaryHNSW {
+    _unused: [u8; 0],
+}
+
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+struct FaissRangeSearchResult {
+    _unused: [u8; 0],
+}
+
 extern "C" {
+    fn faiss_index_factory(
+        index: *mut *mut FaissFloatIndex,
+        d: i32,
+        description: *const c_char,
+        metric: i32,
+    );
+
+    fn faiss_Index_free(index: *mut FaissFloatIndex);
+
     fn faiss_index_binary_factory(
         index: *mut *mut FaissIndexBinary,
         d: i32,
@@ -51,8 +82,33 @@ extern "C" {
         labels: *mut i64,
     );
 
+    fn faiss_IndexBinary_range_search(
+        index: *const FaissIndexBinary,
+        n: i64,
+        x: *const u8,
+        radius: i32,
+        result: *mut FaissRangeSearchResult,
+    );
+
+    fn faiss_IndexBinary_assign(
+        index: *mut FaissIndexBinary,
+        n: i64,
+        x: *const u8,
+        labels: *mut i64,
+        k: i64,
+    );
+
+    fn faiss_IndexBinary_reset(index: *mut FaissIndexBinary);
+
     fn faiss_IndexBinary_free(index: *mut FaissIndexBinary);
 
+    fn faiss_IndexBinary_reconstruct_n(
+        index: *const FaissIndexBinary,
+        i0: i64,
+        ni: i64,
+        recons: *mut u8,
+    ) -> i32;
+
     fn faiss_write_index_binary_fname(index: *const FaissIndexBinary, f: *const c_char);
 
     fn faiss_read_index_binary_fname(
@@ -64,15 +120,433 @@ extern "C" {
     fn faiss_IndexBinaryIVF_set_nprobe(index: *mut FaissIndexBinaryIVF, nprobe: usize);
 
     fn faiss_IndexBinaryIVF_nlist(index: *const FaissIndexBinaryIVF) -> usize;
+
+    fn faiss_IndexBinaryIVF_set_clustering_index(
+        index: *mut FaissIndexBinaryIVF,
+        clustering_index: *mut FaissFloatIndex,
+    );
+
+    fn faiss_IndexBinaryIVF_nprobe(index: *const FaissIndexBinaryIVF) -> usize;
+
+    fn faiss_IndexBinaryIVF_quantizer(index: *const FaissIndexBinaryIVF) -> *mut FaissIndexBinary;
+
+    fn faiss_IndexBinaryIVF_get_list(
+        index: *const FaissIndexBinaryIVF,
+        list_no: usize,
+        size: *mut usize,
+        codes: *mut *const u8,
+        ids: *mut *const i64,
+    );
+
+    fn faiss_IndexBinaryIVF_search_nprobe(
+        index: *const FaissIndexBinaryIVF,
+        n: i64,
+        x: *const u8,
+        k: i64,
+        nprobe: usize,
+        distances: *mut i32,
+        labels: *mut i64,
+    ) -> i32;
+
+    fn faiss_IndexBinaryIVF_merge_from(
+        index: *mut FaissIndexBinaryIVF,
+        other: *mut FaissIndexBinaryIVF,
+        add_id: i64,
+    ) -> i32;
+
+    fn faiss_IndexBinaryIVF_merge_ondisk(
+        index: *mut FaissIndexBinaryIVF,
+        shards: *const *const FaissIndexBinaryIVF,
+        n: usize,
+        filename: *const c_char,
+    ) -> i32;
+
+    fn faiss_IndexBinaryIVF_clear_invlists(index: *mut FaissIndexBinaryIVF) -> i32;
+
+    fn faiss_IndexBinaryIVF_prefetch_quantizer(
+        index: *const FaissIndexBinaryIVF,
+        bytes: *mut usize,
+    ) -> i32;
+
+    fn faiss_IndexBinaryHNSW_cast(index: *mut FaissIndexBinary) -> *mut FaissIndexBinaryHNSW;
+
+    fn faiss_IndexBinaryHNSW_efSearch(index: *const FaissIndexBinaryHNSW) -> i32;
+
+    fn faiss_IndexBinaryHNSW_set_efSearch(index: *mut FaissIndexBinaryHNSW, ef: i32);
+
+    fn faiss_RangeSearchResult_new(result: *mut *mut FaissRangeSearchResult, nq: i64);
+
+    fn faiss_RangeSearchResult_free(result: *mut FaissRangeSearchResult);
+
+    fn faiss_RangeSearchResult_lims(result: *mut FaissRangeSearchResult, lims: *mut *mut usize);
+
+    fn faiss_RangeSearchResult_labels(
+        result: *mut FaissRangeSearchResult,
+        labels: *mut *mut i64,
+        distances: *mut *mut f32,
+    );
+
+    fn omp_set_num_threads(num_threads: i32);
+
+    fn omp_get_max_threads() -> i32;
 }
 
+/// Set the OpenMP threads of regions started from this thread, until it is dropped
+///
+/// Searches run on rayon threads which are shared with other work, so the old value is restored
+struct OmpThreads(Option<i32>);
+
+impl OmpThreads {
+    /// 0 keeps the current value
+    fn set(threads: usize) -> Self {
+        if threads == 0 {
+            return Self(None);
+        }
+        let old = unsafe { omp_get_max_threads() };
+        unsafe { omp_set_num_threads(threads as i32) };
+        Self(Some(old))
+    }
+}
+
+impl Drop for OmpThreads {
+    fn drop(&mut self) {
+        if let Some(old) = self.0 {
+            unsafe { omp_set_num_threads(old) };
+        }
+    }
+}
+
+#[derive(Debug, Copy, Clone)]
 pub struct Neighbor {
     pub index: usize,
     pub distance: u32,
 }
 
+/// Flat knn search result, row `i` holds the neighbors of query point `i`
+#[derive(Debug, Default)]
+pub struct SearchResult {
+    knn: usize,
+    labels: Vec<i64>,
+    distances: Vec<i32>,
+}
+
+impl SearchResult {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Resize to `n` rows of `knn` neighbors, keeping the allocated memory
+    fn resize(&mut self, n: usize, knn: usize) {
+        self.knn = knn;
+        self.labels.resize(n * knn, -1);
+        self.distances.resize(n * knn, 0);
+    }
+
+    /// Overwrite row `i`, missing neighbors are padded with -1 like faiss does
+    fn set_row(&mut self, i: usize, neighbors: &[Neighbor]) {
+        let start = i * self.knn;
+        for j in 0..self.knn {
+            let (label, distance) = match neighbors.get(j) {
+                Some(neighbor) => (neighbor.index as i64, neighbor.distance as i32),
+                None => (-1, i32::MAX),
+            };
+            self.labels[start + j] = label;
+            self.distances[start + j] = distance;
+        }
+    }
+
+    /// Number of query points
+    pub fn rows(&self) -> usize {
+        match self.knn {
+            0 => 0,
+            knn => self.labels.len() / knn,
+        }
+    }
+
+    /// Neighbors of query point `i`, nearest first
+    pub fn row(&self, i: usize) -> impl Iterator<Item = Neighbor> + '_ {
+        let range = i * self.knn..(i + 1) * self.knn;
+        Self::neighbors(&self.labels[range.clone()], &self.distances[range])
+    }
+
+    /// Neighbors of all query points
+    pub fn iter(&self) -> impl Iterator<Item = Neighbor> + '_ {
+        Self::neighbors(&self.labels, &self.distances)
+    }
+
+    fn neighbors<'a>(
+        labels: &'a [i64],
+        distances: &'a [i32],
+    ) -> impl Iterator<Item = Neighbor> + 'a {
+        labels
+            .iter()
+            .zip(distances)
+            // faiss pads missing results with -1
+            .filter(|(&label, _)| label >= 0)
+            .map(|(&label, &distance)| Neighbor {
+                index: label as usize,
+                distance: distance as u32,
+            })
+    }
+}
+
+/// Result of a range search, every query point has a variable number of neighbors
+pub struct RangeSearchResult {
+    result: *mut FaissRangeSearchResult,
+    nq: usize,
+}
+
+impl RangeSearchResult {
+    fn new(nq: usize) -> Self {
+        let mut result = std::ptr::null_mut();
+        unsafe {
+            faiss_RangeSearchResult_new(&mut result, nq as i64);
+        }
+        Self { result, nq }
+    }
+
+    fn raw(&self) -> (&[usize], &[i64], &[f32]) {
+        let mut lims = std::ptr::null_mut();
+        let mut labels = std::ptr::null_mut();
+        let mut distances = std::ptr::null_mut();
+        unsafe {
+            faiss_RangeSearchResult_lims(self.result, &mut lims);
+            faiss_RangeSearchResult_labels(self.result, &mut labels, &mut distances);
+            let lims = std::slice::from_raw_parts(lims, self.nq + 1);
+            let total = lims[self.nq];
+            if total == 0 {
+                return (lims, &[], &[]);
+            }
+            (
+                lims,
+                std::slice::from_raw_parts(labels, total),
+                std::slice::from_raw_parts(distances, total),
+            )
+        }
+    }
+
+    /// Number of query points
+    pub fn rows(&self) -> usize {
+        self.nq
+    }
+
+    /// Neighbors of query point `i`, in no particular order
+    pub fn row(&self, i: usize) -> impl Iterator<Item = Neighbor> + '_ {
+        let (lims, labels, distances) = self.raw();
+        let range = lims[i]..lims[i + 1];
+        Self::neighbors(&labels[range.clone()], &distances[range])
+    }
+
+    /// Neighbors of all query points
+    pub fn iter(&self) -> impl Iterator<Item = Neighbor> + '_ {
+        let (_, labels, distances) = self.raw();
+        Self::neighbors(labels, distances)
+    }
+
+    fn neighbors<'a>(
+        labels: &'a [i64],
+        distances: &'a [f32],
+    ) -> impl Iterator<Item = Neighbor> + 'a {
+        labels
+            .iter()
+            .zip(distances)
+            .map(|(&label, &distance)| Neighbor {
+                index: label as usize,
+                distance: distance as u32,
+            })
+    }
+}
+
+impl Drop for RangeSearchResult {
+    fn drop(&mut self) {
+        unsafe {
+            faiss_RangeSearchResult_free(self.result);
+        }
+    }
+}
+
+unsafe impl Send for RangeSearchResult {}
+
+/// How many times each inverted list was probed, used to choose the lists to warm up
+///
+/// Saved as one native-endian u64 per list, so the statistics survive restarts
+pub struct ListHits(Vec<AtomicU64>);
+
+impl ListHits {
+    pub fn new(nlist: usize) -> Self {
+        Self((0..nlist).map(|_| AtomicU64::new(0)).collect())
+    }
+
+    /// Load saved statistics, they are ignored if missing or written for another index
+    pub fn load<P: AsRef<Path>>(path: P, nlist: usize) -> Self {
+        let hits = Self::new(nlist);
+        if let Ok(bytes) = std::fs::read(path) {
+            if bytes.len() == nlist * 8 {
+                for (hit, chunk) in hits.0.iter().zip(bytes.chunks_exact(8)) {
+                    let mut count = [0u8; 8];
+                    count.copy_from_slice(chunk);
+                    hit.store(u64::from_ne_bytes(count), Ordering::Relaxed);
+                }
+            }
+        }
+        hits
+    }
+
+    /// Save through a temporary file
+    pub fn save<P: AsRef<Path>>(&self, path: P) -> std::io::Result<()> {
+        let mut tmp_file = path.as_ref().to_path_buf();
+        tmp_file.set_extension("tmp");
+
+        let mut file = std::fs::File::create(&tmp_file)?;
+        for hit in self.0.iter() {
+            file.write_all(&hit.load(Ordering::Relaxed).to_ne_bytes())?;
+        }
+        file.sync_all()?;
+        std::fs::rename(&tmp_file, path)
+    }
+
+    /// Add the counts of another index with the same lists, used when shards are merged
+    pub fn add_from(&self, other: &Self) {
+        for (hit, count) in self.0.iter().zip(other.0.iter()) {
+            hit.fetch_add(count.load(Ordering::Relaxed), Ordering::Relaxed);
+        }
+    }
+
+    fn add(&self, list_no: usize) {
+        if let Some(hit) = self.0.get(list_no) {
+            hit.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    fn get(&self, list_no: usize) -> u64 {
+        self.0[list_no].load(Ordering::Relaxed)
+    }
+
+    fn len(&self) -> usize {
+        self.0.len()
+    }
+
+    fn copy_of(other: &Self) -> Self {
+        Self(
+            other
+                .0
+                .iter()
+                .map(|hit| AtomicU64::new(hit.load(Ordering::Relaxed)))
+                .collect(),
+        )
+    }
+}
+
+/// Ask the kernel to read a range of a mapped file ahead
+fn will_need(ptr: *const u8, len: usize) {
+    if len == 0 {
+        return;
+    }
+    let page = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
+    let start = ptr as usize / page * page;
+    let len = ptr as usize + len - start;
+    // only a hint, failures on memory which isn't mapped from a file don't matter
+    unsafe {
+        libc::madvise(start as *mut libc::c_void, len, libc::MADV_WILLNEED);
+    }
+}
+
+/// Reusable buffers for `MultiFaissIndex::search`
+#[derive(Debug, Default)]
+pub struct SearchBuffer {
+    shards: Vec<SearchResult>,
+    merged: SearchResult,
+    row: Vec<Neighbor>,
+}
+
+/// An index file searched as a part of `MultiFaissIndex`
+pub struct Shard {
+    path: PathBuf,
+    modified: Option<SystemTime>,
+    index: FaissIndex,
+    hits: ListHits,
+    /// Latency of searching this shard, exported by the server
+    pub search_time: Histogram,
+}
+
+impl Shard {
+    fn open(path: PathBuf, mmap: bool, hits_dir: Option<&Path>) -> Self {
+        let modified = Self::modified(&path);
+        let index = FaissIndex::from_file(&*path.to_string_lossy(), mmap);
+        let hits = match hits_dir {
+            Some(dir) => ListHits::load(dir.join(path.file_name().unwrap()), index.nlist()),
+            None => ListHits::new(index.nlist()),
+        };
+        Self {
+            path,
+            modified,
+            index,
+            hits,
+            search_time: Histogram::default(),
+        }
+    }
+
+    pub fn path(&self) -> &Path {
+        &self.path
+    }
+
+    fn modified(path: &Path) -> Option<SystemTime> {
+        std::fs::metadata(path)
+            .and_then(|meta| meta.modified())
+            .ok()
+    }
+
+    /// Count the lists scanned for `points` query descriptors, and the neighbors found
+    fn count_work(&self, points: usize, nprobe: usize, candidates: usize) {
+        let lists = nprobe.min(self.index.nlist());
+        METRICS.lists_scanned.add((points * lists) as u64);
+        METRICS.candidates.add(candidates as u64);
+    }
+}
+
+/// Shards to load and retire, found by `MultiFaissIndex::plan_reload`
+#[derive(Debug, Default, Clone)]
+pub struct ReloadPlan {
+    pub load: Vec<PathBuf>,
+    pub retire: Vec<PathBuf>,
+    hits_dir: Option<PathBuf>,
+}
+
+impl ReloadPlan {
+    pub fn is_empty(&self) -> bool {
+        self.load.is_empty() && self.retire.is_empty()
+    }
+
+    /// Read the shards to load, this may take long and needs no lock on the index
+    pub fn load(self, mmap: bool) -> ShardUpdate {
+        let hits_dir = self.hits_dir.as_deref();
+        let shards = self
+            .load
+            .iter()
+            .map(|path| {
+                info!("loading index shard {}", path.display());
+                Shard::open(path.clone(), mmap, hits_dir)
+            })
+            .collect();
+        ShardUpdate {
+            shards,
+            retire: self.retire,
+        }
+    }
+}
+
+/// Loaded shards waiting to be swapped in by `MultiFaissIndex::apply`
+pub struct ShardUpdate {
+    shards: Vec<Shard>,
+    retire: Vec<PathBuf>,
+}
+
 pub struct MultiFaissIndex {
-    index: Vec<FaissIndex>,
+    shards: Vec<Shard>,
+    hits_dir: Option<PathBuf>,
+    nprobe: Option<usize>,
+    ef_search: Option<usize>,
+    shard_threads: usize,
 }
 
 impl MultiFaissIndex {
@@ -81,27 +555,356 @@ impl MultiFaissIndex {
         I: IntoIterator<Item = P>,
         P: AsRef<Path>,
     {
-        let index = path
+        let shards = path
             .into_iter()
-            .map(|path| FaissIndex::from_file(&*path.as_ref().to_string_lossy(), mmap))
+            .map(|path| Shard::open(path.as_ref().to_path_buf(), mmap, None))
             .collect();
-        Self { index }
+        Self {
+            shards,
+            hits_dir: None,
+            nprobe: None,
+            ef_search: None,
+            shard_threads: 0,
+        }
     }
 
-    pub fn search<M>(&self, points: &M, knn: usize) -> Vec<Vec<Neighbor>>
+    pub fn shards(&self) -> &[Shard] {
+        &self.shards
+    }
+
+    /// Compare the loaded shards with the index files in `paths`
+    ///
+    /// New files are loaded, files modified since they were loaded are loaded again, and shards
+    /// whose file is gone are retired
+    pub fn plan_reload<I, P>(&self, paths: I) -> ReloadPlan
+    where
+        I: IntoIterator<Item = P>,
+        P: AsRef<Path>,
+    {
+        let paths = paths
+            .into_iter()
+            .map(|path| path.as_ref().to_path_buf())
+            .collect::<Vec<_>>();
+        let mut plan = ReloadPlan {
+            hits_dir: self.hits_dir.clone(),
+            ..Default::default()
+        };
+        for path in paths.iter() {
+            match self.shards.iter().find(|shard| &shard.path == path) {
+                Some(shard) if shard.modified == Shard::modified(path) => {}
+                _ => plan.load.push(path.clone()),
+            }
+        }
+        for shard in self.shards.iter() {
+            if !paths.contains(&shard.path) {
+                plan.retire.push(shard.path.clone());
+            }
+        }
+        plan
+    }
+
+    /// Swap in loaded shards, replacing the shards of the same files
+    ///
+    /// Return the replaced and retired shards, so they can be dropped after releasing the lock
+    pub fn apply(&mut self, update: ShardUpdate) -> Vec<Shard> {
+        let ShardUpdate { shards, retire } = update;
+        let (old, kept) = std::mem::take(&mut self.shards)
+            .into_iter()
+            .partition::<Vec<_>, _>(|shard| {
+                retire.contains(&shard.path) || shards.iter().any(|new| new.path == shard.path)
+            });
+        self.shards = kept;
+        for mut shard in shards {
+            if let Some(nprobe) = self.nprobe {
+                shard.index.set_nprobe(nprobe);
+            }
+            if let Some(ef) = self.ef_search {
+                shard.index.set_ef_search(ef);
+            }
+            // a rebuilt shard keeps the statistics of the file it replaces
+            if let Some(prev) = old.iter().find(|prev| prev.path == shard.path) {
+                if prev.hits.len() == shard.hits.len() {
+                    shard.hits = ListHits::copy_of(&prev.hits);
+                }
+            }
+            self.shards.push(shard);
+        }
+        old
+    }
+
+    /// Load the list statistics of every shard saved in `dir`, shards loaded later use it too
+    pub fn load_list_hits<P: AsRef<Path>>(&mut self, dir: P) {
+        for shard in self.shards.iter_mut() {
+            let path = dir.as_ref().join(shard.path.file_name().unwrap());
+            shard.hits = ListHits::load(path, shard.index.nlist());
+        }
+        self.hits_dir = Some(dir.as_ref().to_path_buf());
+    }
+
+    /// Copy the list statistics of every shard, with the name of its shard file
+    ///
+    /// The copy can be saved by `save_list_hits` without holding on to the index
+    pub fn list_hits(&self) -> Vec<(OsString, ListHits)> {
+        self.shards
+            .iter()
+            .map(|shard| {
+                let name = shard.path.file_name().unwrap().to_owned();
+                (name, ListHits::copy_of(&shard.hits))
+            })
+            .collect()
+    }
+
+    /// Save statistics from `list_hits` to `dir`, named after the shard files
+    pub fn save_list_hits<P: AsRef<Path>>(
+        dir: P,
+        hits: &[(OsString, ListHits)],
+    ) -> std::io::Result<()> {
+        std::fs::create_dir_all(dir.as_ref())?;
+        for (name, hits) in hits {
+            hits.save(dir.as_ref().join(name))?;
+        }
+        Ok(())
+    }
+
+    /// Count the inverted lists which a search of `points` would probe
+    ///
+    /// This runs the coarse quantizer a second time, so it is meant for a sample of queries
+    pub fn record_probes<M>(&self, points: &M)
+    where
+        M: Matrix,
+    {
+        for shard in self.shards.iter() {
+            shard.index.probe_lists(points, &shard.hits);
+        }
+    }
+
+    /// Prefetch the quantizers of all shards, which every query reads, then their most probed
+    /// inverted lists, until `max_bytes` are prefetched
+    ///
+    /// Lists which were never probed come last, larger lists first. Return the prefetched bytes
+    pub fn warmup(&self, max_bytes: usize) -> usize {
+        let start = Instant::now();
+        let mut total = self
+            .shards
+            .iter()
+            .map(|shard| shard.index.prefetch_quantizer())
+            .sum::<usize>();
+
+        let mut lists = self
+            .shards
+            .iter()
+            .enumerate()
+            .flat_map(|(i, shard)| {
+                (0..shard.index.nlist()).map(move |list_no| {
+                    (
+                        shard.hits.get(list_no),
+                        shard.index.list_bytes(list_no),
+                        i,
+                        list_no,
+                    )
+                })
+            })
+            .collect::<Vec<_>>();
+        lists.sort_unstable_by(|a, b| (b.0, b.1).cmp(&(a.0, a.1)));
+
+        for (_, bytes, i, list_no) in lists {
+            if total + bytes > max_bytes {
+                break;
+            }
+            self.shards[i].index.prefetch_list(list_no);
+            total += bytes;
+        }
+        info!(
+            "warmup: prefetched {} MiB in {:.2}s",
+            total >> 20,
+            start.elapsed().as_secs_f32()
+        );
+        total
+    }
+
+    /// Search all shards concurrently, and merge their results into the top `knn` of each point
+    ///
+    /// The result is written to `buffer`, which can be reused between calls to avoid allocation
+    pub fn search<'b, M>(
+        &self,
+        points: &M,
+        knn: usize,
+        buffer: &'b mut SearchBuffer,
+    ) -> &'b SearchResult
+    where
+        M: Matrix,
+    {
+        self.search_nprobe(points, knn, None, buffer)
+    }
+
+    /// Like `search`, but probe `nprobe` lists of every shard in this call only, if given
+    ///
+    /// The shards are not modified, so this only needs a read lock on the index
+    pub fn search_nprobe<'b, M>(
+        &self,
+        points: &M,
+        knn: usize,
+        nprobe: Option<usize>,
+        buffer: &'b mut SearchBuffer,
+    ) -> &'b SearchResult
+    where
+        M: Matrix,
+    {
+        if points.height() == 0 {
+            buffer.merged.resize(0, knn);
+            return &buffer.merged;
+        }
+        // SAFETY: a Matrix is a continuous array of height * width bytes
+        let data = unsafe {
+            std::slice::from_raw_parts(points.as_ptr(), points.width() * points.height())
+        };
+        let points = MatrixView::new(points.width(), data);
+
+        let start = Instant::now();
+        buffer
+            .shards
+            .resize_with(self.shards.len(), SearchResult::new);
+        let omp_threads = self.omp_threads();
+        self.shards
+            .par_iter()
+            .zip(buffer.shards.par_iter_mut())
+            .for_each(|(shard, result)| {
+                let _omp_threads = OmpThreads::set(omp_threads);
+                let start = Instant::now();
+                let nprobe = match nprobe {
+                    Some(nprobe) => {
+                        shard.index.search_nprobe_into(&points, knn, nprobe, result);
+                        nprobe
+                    }
+                    None => {
+                        shard.index.search_into(&points, knn, result);
+                        shard.index.nprobe()
+                    }
+                };
+                shard.search_time.observe_since(start);
+                shard.count_work(points.height(), nprobe, result.iter().count());
+            });
+        METRICS.search.observe_since(start);
+
+        if self.shards.len() == 1 {
+            return &buffer.shards[0];
+        }
+
+        let SearchBuffer {
+            shards,
+            merged,
+            row,
+        } = buffer;
+        merged.resize(points.height(), knn);
+        for i in 0..points.height() {
+            row.clear();
+            row.extend(shards.iter().flat_map(|shard| shard.row(i)));
+            row.sort_unstable_by_key(|neighbor| neighbor.distance);
+            row.truncate(knn);
+            merged.set_row(i, row);
+        }
+        merged
+    }
+
+    /// Find all neighbors with a distance <= `max_distance` in every shard, one result per shard
+    pub fn range_search<M>(&self, points: &M, max_distance: u32) -> Vec<RangeSearchResult>
     where
         M: Matrix,
     {
-        let mut v = vec![];
-        for index in self.index.iter() {
-            v.extend(index.search(points, knn))
+        if points.height() == 0 {
+            return vec![];
         }
-        v
+        // SAFETY: a Matrix is a continuous array of height * width bytes
+        let data = unsafe {
+            std::slice::from_raw_parts(points.as_ptr(), points.width() * points.height())
+        };
+        let points = MatrixView::new(points.width(), data);
+
+        let start = Instant::now();
+        let omp_threads = self.omp_threads();
+        let results = self
+            .shards
+            .par_iter()
+            .map(|shard| {
+                let _omp_threads = OmpThreads::set(omp_threads);
+                let start = Instant::now();
+                let result = shard.index.range_search(&points, max_distance);
+                shard.search_time.observe_since(start);
+                shard.count_work(points.height(), shard.index.nprobe(), result.iter().count());
+                result
+            })
+            .collect();
+        METRICS.search.observe_since(start);
+        results
+    }
+
+    /// Set how many OpenMP threads each shard may use during search, 0 means the OpenMP default
+    ///
+    /// Shards are searched at once on rayon threads, so up to shards * threads run together.
+    /// The threads are lowered so that this stays within the number of CPUs
+    pub fn set_shard_threads(&mut self, threads: usize) {
+        self.shard_threads = threads;
+    }
+
+    /// `shard_threads`, bounded by the CPUs left to each of the shards searched at once
+    fn omp_threads(&self) -> usize {
+        if self.shard_threads == 0 {
+            return 0;
+        }
+        let concurrent = self.shards.len().min(rayon::current_num_threads()).max(1);
+        self.shard_threads
+            .min((num_cpus::get() / concurrent).max(1))
     }
 
     pub fn set_nprobe(&mut self, nprobe: usize) {
-        for index in self.index.iter_mut() {
-            index.set_nprobe(nprobe)
+        self.nprobe = Some(nprobe);
+        for shard in self.shards.iter_mut() {
+            shard.index.set_nprobe(nprobe)
+        }
+    }
+
+    /// nprobe set by `set_nprobe`, None if shards use their own
+    pub fn nprobe(&self) -> Option<usize> {
+        self.nprobe
+    }
+
+    /// efSearch set by `set_ef_search`, None if shards use their own
+    pub fn ef_search(&self) -> Option<usize> {
+        self.ef_search
+    }
+
+    /// Set efSearch of shards with an HNSW quantizer, other shards are not affected
+    pub fn set_ef_search(&mut self, ef: usize) {
+        self.ef_search = Some(ef);
+        for shard in self.shards.iter_mut() {
+            shard.index.set_ef_search(ef)
+        }
+    }
+}
+
+/// A float index used for the k-means of `FaissIndex::train_with_clustering`
+pub struct ClusteringIndex {
+    index: *mut FaissFloatIndex,
+}
+
+impl ClusteringIndex {
+    /// Build an L2 index from a faiss index_factory description, such as `Flat` or `HNSW32`
+    pub fn new(d: i32, description: &str) -> Self {
+        let mut index = std::ptr::null_mut();
+        let description = CString::new(description).unwrap();
+        unsafe {
+            // METRIC_L2
+            faiss_index_factory(&mut index, d, description.as_ptr(), 1);
+        }
+        assert!(!index.is_null(), "failed to create clustering index");
+        Self { index }
+    }
+}
+
+impl Drop for ClusteringIndex {
+    fn drop(&mut self) {
+        unsafe {
+            faiss_Index_free(self.index);
         }
     }
 }
@@ -160,6 +963,18 @@ impl FaissIndex {
         }
     }
 
+    /// Train an IVF index, running its k-means on `clustering` instead of a flat index
+    pub fn train_with_clustering<M>(&mut self, v: &M, clustering: &ClusteringIndex)
+    where
+        M: Matrix,
+    {
+        let ivf = self.index as *mut FaissIndexBinaryIVF;
+        unsafe { faiss_IndexBinaryIVF_set_clustering_index(ivf, clustering.index) };
+        self.train(v);
+        // the index doesn't own it, and it is freed after training
+        unsafe { faiss_IndexBinaryIVF_set_clustering_index(ivf, std::ptr::null_mut()) };
+    }
+
     pub fn add<M>(&mut self, v: &M)
     where
         M: Matrix,
@@ -181,13 +996,41 @@ impl FaissIndex {
         }
     }
 
+    /// Remove all vectors from the index, the trained quantizer is kept
+    pub fn reset(&mut self) {
+        unsafe {
+            faiss_IndexBinary_reset(self.index);
+        }
+    }
+
+    /// Read an empty IVF index with the quantizer of the index in `path`
+    ///
+    /// The inverted lists are mapped instead of read, and replaced by empty lists in memory
+    pub fn empty_from_file(path: &str) -> Self {
+        let index = Self::from_file(path, true);
+        let ret = unsafe { faiss_IndexBinaryIVF_clear_invlists(index.index as *mut _) };
+        assert_eq!(ret, 0, "failed to clear inverted lists");
+        index
+    }
+
     pub fn search<M>(&self, points: &M, knn: usize) -> Vec<Vec<Neighbor>>
+    where
+        M: Matrix,
+    {
+        let mut result = SearchResult::new();
+        self.search_into(points, knn, &mut result);
+        (0..result.rows())
+            .map(|i| result.row(i).collect())
+            .collect()
+    }
+
+    /// Search into a reusable result, without allocating once it is large enough
+    pub fn search_into<M>(&self, points: &M, knn: usize, result: &mut SearchResult)
     where
         M: Matrix,
     {
         assert_eq!(points.width() * 8, self.d as usize);
-        let mut dists = vec![0i32; points.height() * knn];
-        let mut indices = vec![0i64; points.height() * knn];
+        result.resize(points.height(), knn);
 
         let start = Instant::now();
         unsafe {
@@ -196,23 +1039,64 @@ impl FaissIndex {
                 points.height() as i64,
                 points.as_ptr(),
                 knn as i64,
-                dists.as_mut_ptr(),
-                indices.as_mut_ptr(),
+                result.distances.as_mut_ptr(),
+                result.labels.as_mut_ptr(),
             );
         }
         debug!("knn search time: {:.2}s", start.elapsed().as_secs_f32());
+    }
 
-        indices
-            .into_iter()
-            .zip(dists.into_iter())
-            .map(|(index, distance)| Neighbor {
-                index: index as usize,
-                distance: distance as u32,
-            })
-            .chunks(knn)
-            .into_iter()
-            .map(|chunk| chunk.collect())
-            .collect()
+    /// Like `search_into`, but probe `nprobe` lists instead of the nprobe of the index
+    ///
+    /// The index is not modified, so this can run concurrently with other searches
+    pub fn search_nprobe_into<M>(
+        &self,
+        points: &M,
+        knn: usize,
+        nprobe: usize,
+        result: &mut SearchResult,
+    ) where
+        M: Matrix,
+    {
+        assert_eq!(points.width() * 8, self.d as usize);
+        result.resize(points.height(), knn);
+
+        let ret = unsafe {
+            faiss_IndexBinaryIVF_search_nprobe(
+                self.index as *const FaissIndexBinaryIVF,
+                points.height() as i64,
+                points.as_ptr(),
+                knn as i64,
+                nprobe.max(1),
+                result.distances.as_mut_ptr(),
+                result.labels.as_mut_ptr(),
+            )
+        };
+        assert_eq!(ret, 0, "failed to search index");
+    }
+
+    /// Find all neighbors with a distance <= `max_distance`
+    pub fn range_search<M>(&self, points: &M, max_distance: u32) -> RangeSearchResult
+    where
+        M: Matrix,
+    {
+        assert_eq!(points.width() * 8, self.d as usize);
+        let result = RangeSearchResult::new(points.height());
+
+        let start = Instant::now();
+        unsafe {
+            // faiss only returns distances < radius
+            faiss_IndexBinary_range_search(
+                self.index,
+                points.height() as i64,
+                points.as_ptr(),
+                max_distance as i32 + 1,
+                result.result,
+            );
+        }
+        debug!("range search time: {:.2}s", start.elapsed().as_secs_f32());
+
+        result
     }
 
     pub fn set_nprobe(&mut self, nprobe: usize) {
@@ -224,6 +1108,169 @@ impl FaissIndex {
     pub fn nlist(&self) -> usize {
         unsafe { faiss_IndexBinaryIVF_nlist(self.index as *const FaissIndexBinaryIVF) }
     }
+
+    pub fn nprobe(&self) -> usize {
+        unsafe { faiss_IndexBinaryIVF_nprobe(self.index as *const FaissIndexBinaryIVF) }
+    }
+
+    /// The quantizer if it is an HNSW graph, i.e. the index was built with `BIVF{nlist}_HNSW{M}`
+    fn hnsw_quantizer(&self) -> Option<*mut FaissIndexBinaryHNSW> {
+        let hnsw = unsafe {
+            let quantizer =
+                faiss_IndexBinaryIVF_quantizer(self.index as *const FaissIndexBinaryIVF);
+            faiss_IndexBinaryHNSW_cast(quantizer)
+        };
+        match hnsw.is_null() {
+            true => None,
+            false => Some(hnsw),
+        }
+    }
+
+    /// efSearch of the HNSW quantizer, None for a flat quantizer
+    pub fn ef_search(&self) -> Option<usize> {
+        self.hnsw_quantizer()
+            .map(|hnsw| unsafe { faiss_IndexBinaryHNSW_efSearch(hnsw) } as usize)
+    }
+
+    /// Set efSearch of the HNSW quantizer, it is at least nprobe during search
+    pub fn set_ef_search(&mut self, ef: usize) {
+        if let Some(hnsw) = self.hnsw_quantizer() {
+            unsafe { faiss_IndexBinaryHNSW_set_efSearch(hnsw, ef as i32) };
+        }
+    }
+
+    /// Count the inverted lists probed by a search of `points` in `hits`
+    pub fn probe_lists<M>(&self, points: &M, hits: &ListHits)
+    where
+        M: Matrix,
+    {
+        assert_eq!(points.width() * 8, self.d as usize);
+        let nprobe = self.nprobe().min(self.nlist());
+        let mut labels = vec![-1i64; points.height() * nprobe];
+        unsafe {
+            let quantizer =
+                faiss_IndexBinaryIVF_quantizer(self.index as *const FaissIndexBinaryIVF);
+            faiss_IndexBinary_assign(
+                quantizer,
+                points.height() as i64,
+                points.as_ptr(),
+                labels.as_mut_ptr(),
+                nprobe as i64,
+            );
+        }
+        for &list_no in labels.iter().filter(|&&label| label >= 0) {
+            hits.add(list_no as usize);
+        }
+    }
+
+    /// Whether both indexes are IVF indexes which share the same coarse quantizer
+    ///
+    /// Every centroid is compared, a block at a time, which is cheap next to a merge
+    pub fn same_quantizer(&self, other: &FaissIndex) -> bool {
+        if self.d != other.d || self.nlist() != other.nlist() {
+            return false;
+        }
+        const BLOCK: usize = 4096;
+        let nlist = self.nlist();
+        let width = self.d as usize / 8;
+        let centroids = |index: &FaissIndex, start: usize, n: usize| {
+            let mut centroids = vec![0u8; n * width];
+            let ret = unsafe {
+                let quantizer =
+                    faiss_IndexBinaryIVF_quantizer(index.index as *const FaissIndexBinaryIVF);
+                faiss_IndexBinary_reconstruct_n(
+                    quantizer,
+                    start as i64,
+                    n as i64,
+                    centroids.as_mut_ptr(),
+                )
+            };
+            (ret == 0).then(|| centroids)
+        };
+        (0..nlist).step_by(BLOCK).all(|start| {
+            let n = BLOCK.min(nlist - start);
+            let centroids_of_self = centroids(self, start, n);
+            centroids_of_self.is_some() && centroids_of_self == centroids(other, start, n)
+        })
+    }
+
+    /// Move all vectors of `other` into this index, `other` is left empty
+    ///
+    /// `other` must not be read with mmap, since its lists are cleared
+    pub fn merge_from(&mut self, other: &mut FaissIndex) {
+        let ret = unsafe {
+            faiss_IndexBinaryIVF_merge_from(
+                self.index as *mut FaissIndexBinaryIVF,
+                other.index as *mut FaissIndexBinaryIVF,
+                0,
+            )
+        };
+        assert_eq!(ret, 0, "failed to merge index");
+    }
+
+    /// Move the vectors of this index and `others` to on-disk inverted lists stored in `filename`
+    ///
+    /// Lists are copied one at a time, so all indexes can be read with mmap
+    pub fn merge_ondisk(&mut self, others: &[FaissIndex], filename: &str) {
+        let shards = std::iter::once(&*self)
+            .chain(others.iter())
+            .map(|index| index.index as *const FaissIndexBinaryIVF)
+            .collect::<Vec<_>>();
+        let filename = CString::new(filename).unwrap();
+        let ret = unsafe {
+            faiss_IndexBinaryIVF_merge_ondisk(
+                self.index as *mut FaissIndexBinaryIVF,
+                shards.as_ptr(),
+                shards.len(),
+                filename.as_ptr(),
+            )
+        };
+        assert_eq!(ret, 0, "failed to merge index");
+    }
+
+    /// Return (size, codes, ids) of an inverted list
+    fn list(&self, list_no: usize) -> (usize, *const u8, *const i64) {
+        let mut size = 0;
+        let mut codes = std::ptr::null();
+        let mut ids = std::ptr::null();
+        unsafe {
+            faiss_IndexBinaryIVF_get_list(
+                self.index as *const FaissIndexBinaryIVF,
+                list_no,
+                &mut size,
+                &mut codes,
+                &mut ids,
+            );
+        }
+        (size, codes, ids)
+    }
+
+    /// Bytes of codes and ids in an inverted list
+    fn list_bytes(&self, list_no: usize) -> usize {
+        let (size, _, _) = self.list(list_no);
+        size * (self.d as usize / 8 + std::mem::size_of::<i64>())
+    }
+
+    /// Read the centroids of the quantizer, and its graph with an HNSW quantizer, into memory
+    ///
+    /// Return the size of the quantizer
+    pub fn prefetch_quantizer(&self) -> usize {
+        let mut bytes = 0;
+        unsafe {
+            faiss_IndexBinaryIVF_prefetch_quantizer(
+                self.index as *const FaissIndexBinaryIVF,
+                &mut bytes,
+            );
+        }
+        bytes
+    }
+
+    /// Start reading an inverted list into the page cache, without waiting for it
+    pub fn prefetch_list(&self, list_no: usize) {
+        let (size, codes, ids) = self.list(list_no);
+        will_need(codes, size * self.d as usize / 8);
+        will_need(ids as *const u8, size * std::mem::size_of::<i64>());
+    }
 }
 
 impl Drop for FaissIndex {
@@ -1,9 +1,14 @@
+pub mod batcher;
+pub mod cache;
 pub mod cmd;
 pub mod config;
 pub mod db;
 pub mod imdb;
 pub mod index;
+pub mod manifest;
 pub mod matrix;
+pub mod metrics;
+pub mod remote;
 pub mod slam3_orb;
 pub mod utils;
 
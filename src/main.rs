@@ -23,9 +23,15 @@ fn main() {
         SubCommand::SearchImage(config) => {
             config.run(&*OPTS).unwrap();
         }
+        SubCommand::TrainIndex(config) => {
+            config.run(&*OPTS).unwrap();
+        }
         SubCommand::BuildIndex(config) => {
             config.run(&*OPTS).unwrap();
         }
+        SubCommand::MergeIndex(config) => {
+            config.run(&*OPTS).unwrap();
+        }
         SubCommand::StartServer(config) => {
             config.run(&*OPTS).unwrap();
         }
@@ -38,5 +44,8 @@ fn main() {
         SubCommand::ExportData(config) => {
             config.run(&*OPTS).unwrap();
         }
+        SubCommand::Benchmark(config) => {
+            config.run(&*OPTS).unwrap();
+        }
     }
 }
@@ -0,0 +1,113 @@
+use std::collections::HashMap;
+use std::fs::{File, Metadata};
+use std::io::{BufReader, BufWriter, Read, Write};
+use std::path::Path;
+use std::time::UNIX_EPOCH;
+
+use anyhow::{bail, Result};
+
+/// Size and modification time of a file, which tell whether it changed since it was scanned
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub struct FileStamp {
+    /// Nanoseconds since the unix epoch
+    pub modified: u64,
+    pub size: u64,
+}
+
+impl FileStamp {
+    pub fn new(metadata: &Metadata) -> Self {
+        let modified = metadata
+            .modified()
+            .ok()
+            .and_then(|time| time.duration_since(UNIX_EPOCH).ok())
+            .map_or(0, |duration| duration.as_nanos() as u64);
+        Self {
+            modified,
+            size: metadata.len(),
+        }
+    }
+}
+
+/// Files already added to the database, so a re-scan can skip them without reading them
+///
+/// Stored as a list of (path length: u32, path, modified: u64, size: u64), all little endian
+#[derive(Debug, Default)]
+pub struct Manifest {
+    files: HashMap<String, FileStamp>,
+}
+
+impl Manifest {
+    /// Load a manifest, an empty one is returned if it doesn't exist
+    pub fn load<P: AsRef<Path>>(path: P) -> Result<Self> {
+        let file = match File::open(path.as_ref()) {
+            Ok(file) => file,
+            Err(e) if e.kind() == std::io::ErrorKind::NotFound => return Ok(Self::default()),
+            Err(e) => return Err(e.into()),
+        };
+        let mut data = vec![];
+        BufReader::new(file).read_to_end(&mut data)?;
+
+        let mut files = HashMap::new();
+        let mut rest = &data[..];
+        while !rest.is_empty() {
+            let (name, stamp, tail) = match Self::read_entry(rest) {
+                Some(entry) => entry,
+                None => bail!("broken manifest: {}", path.as_ref().display()),
+            };
+            files.insert(name, stamp);
+            rest = tail;
+        }
+        Ok(Self { files })
+    }
+
+    fn read_entry(data: &[u8]) -> Option<(String, FileStamp, &[u8])> {
+        let u64_at = |i: usize| {
+            let mut bytes = [0u8; 8];
+            bytes.copy_from_slice(data.get(i..i + 8)?);
+            Some(u64::from_le_bytes(bytes))
+        };
+        let mut len = [0u8; 4];
+        len.copy_from_slice(data.get(..4)?);
+        let len = u32::from_le_bytes(len) as usize;
+        let name = String::from_utf8(data.get(4..4 + len)?.to_vec()).ok()?;
+        let stamp = FileStamp {
+            modified: u64_at(4 + len)?,
+            size: u64_at(12 + len)?,
+        };
+        Some((name, stamp, &data[20 + len..]))
+    }
+
+    /// Save through a temporary file
+    pub fn save<P: AsRef<Path>>(&self, path: P) -> Result<()> {
+        let mut tmp_file = path.as_ref().to_path_buf();
+        tmp_file.set_extension("tmp");
+
+        let mut file = BufWriter::new(File::create(&tmp_file)?);
+        for (name, stamp) in self.files.iter() {
+            file.write_all(&(name.len() as u32).to_le_bytes())?;
+            file.write_all(name.as_bytes())?;
+            file.write_all(&stamp.modified.to_le_bytes())?;
+            file.write_all(&stamp.size.to_le_bytes())?;
+        }
+        file.into_inner().map_err(|e| e.into_error())?.sync_all()?;
+        std::fs::rename(&tmp_file, path)?;
+        Ok(())
+    }
+
+    /// Whether the file is unchanged since it was added
+    pub fn contains(&self, path: &str, stamp: FileStamp) -> bool {
+        self.files.get(path) == Some(&stamp)
+    }
+
+    pub fn insert(&mut self, path: String, stamp: FileStamp) {
+        self.files.insert(path, stamp);
+    }
+
+    pub fn len(&self) -> usize {
+        self.files.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.files.is_empty()
+    }
+}
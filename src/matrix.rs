@@ -65,6 +65,24 @@ impl Matrix for Mat {
     }
 }
 
+impl<M: Matrix> Matrix for &M {
+    fn width(&self) -> usize {
+        (**self).width()
+    }
+
+    fn height(&self) -> usize {
+        (**self).height()
+    }
+
+    fn as_ptr(&self) -> *const u8 {
+        (**self).as_ptr()
+    }
+
+    fn line(&self, n: usize) -> &[u8] {
+        (**self).line(n)
+    }
+}
+
 #[derive(Debug)]
 pub struct Matrix2D {
     width: usize,
@@ -81,6 +99,23 @@ impl Matrix2D {
         }
     }
 
+    pub fn with_capacity(width: usize, height: usize) -> Self {
+        Self {
+            width,
+            height: 0,
+            data: Vec::with_capacity(width * height),
+        }
+    }
+
+    /// Copy all lines of another matrix
+    pub fn from_matrix<M: Matrix>(matrix: &M) -> Self {
+        let mut result = Self::with_capacity(matrix.width(), matrix.height());
+        for line in (0..matrix.height()).map(|i| matrix.line(i)) {
+            result.push(line);
+        }
+        result
+    }
+
     pub fn push(&mut self, v: &[u8]) {
         assert_eq!(self.width, v.len());
         self.height += 1;
@@ -91,6 +126,10 @@ impl Matrix2D {
         self.height = 0;
         self.data.clear();
     }
+
+    pub fn line_mut(&mut self, n: usize) -> &mut [u8] {
+        &mut self.data[n * self.width..(n + 1) * self.width]
+    }
 }
 
 impl Matrix for Matrix2D {
@@ -111,9 +150,41 @@ impl Matrix for Matrix2D {
     }
 }
 
+/// A borrowed view of a continuous 2d u8 array
+#[derive(Debug, Copy, Clone)]
+pub struct MatrixView<'a> {
+    width: usize,
+    data: &'a [u8],
+}
+
+impl<'a> MatrixView<'a> {
+    pub fn new(width: usize, data: &'a [u8]) -> Self {
+        assert_eq!(data.len() % width, 0);
+        Self { width, data }
+    }
+}
+
+impl<'a> Matrix for MatrixView<'a> {
+    fn width(&self) -> usize {
+        self.width
+    }
+
+    fn height(&self) -> usize {
+        self.data.len() / self.width
+    }
+
+    fn as_ptr(&self) -> *const u8 {
+        self.data.as_ptr()
+    }
+
+    fn line(&self, n: usize) -> &[u8] {
+        &self.data[n * self.width..(n + 1) * self.width]
+    }
+}
+
 #[cfg(test)]
 mod tests {
-    use super::Matrix;
+    use super::{Matrix, MatrixView};
     use opencv::prelude::*;
 
     #[test]
@@ -126,4 +197,13 @@ mod tests {
         assert_eq!(iter.next(), Some(&[3u8, 4][..]));
         assert_eq!(iter.next(), None);
     }
+
+    #[test]
+    fn view_lines() {
+        let data = [1u8, 2, 3, 4, 5, 6];
+        let view = MatrixView::new(2, &data[2..]);
+
+        assert_eq!(view.height(), 2);
+        assert_eq!(view.line(1), &[5u8, 6][..]);
+    }
 }
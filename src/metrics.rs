@@ -0,0 +1,186 @@
+use std::fmt::Write;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::Instant;
+
+use crate::slam3_orb::StageTimes;
+use once_cell::sync::Lazy;
+
+/// Upper bounds of the latency buckets, in seconds
+const BUCKETS: [f64; 14] = [
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0,
+];
+
+/// A latency histogram with fixed buckets, which can be updated from any thread
+pub struct Histogram {
+    buckets: [AtomicU64; BUCKETS.len()],
+    count: AtomicU64,
+    sum_nanos: AtomicU64,
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Self {
+            buckets: Default::default(),
+            count: AtomicU64::new(0),
+            sum_nanos: AtomicU64::new(0),
+        }
+    }
+}
+
+impl Histogram {
+    pub fn observe(&self, seconds: f64) {
+        if let Some(i) = BUCKETS.iter().position(|&bound| seconds <= bound) {
+            self.buckets[i].fetch_add(1, Ordering::Relaxed);
+        }
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.sum_nanos
+            .fetch_add((seconds * 1e9) as u64, Ordering::Relaxed);
+    }
+
+    pub fn observe_since(&self, start: Instant) {
+        self.observe(start.elapsed().as_secs_f64())
+    }
+
+    /// Write the histogram in the Prometheus text format, `labels` is empty or like `a="b"`
+    pub fn render(&self, out: &mut String, name: &str, labels: &str) {
+        let separator = if labels.is_empty() { "" } else { "," };
+        let mut cumulative = 0;
+        for (bound, bucket) in BUCKETS.iter().zip(self.buckets.iter()) {
+            cumulative += bucket.load(Ordering::Relaxed);
+            let _ = writeln!(
+                out,
+                "{}_bucket{{{}{}le=\"{}\"}} {}",
+                name, labels, separator, bound, cumulative
+            );
+        }
+        let count = self.count.load(Ordering::Relaxed);
+        let _ = writeln!(
+            out,
+            "{}_bucket{{{}{}le=\"+Inf\"}} {}",
+            name, labels, separator, count
+        );
+        let sum = self.sum_nanos.load(Ordering::Relaxed) as f64 / 1e9;
+        let labels = match labels.is_empty() {
+            true => String::new(),
+            false => format!("{{{}}}", labels),
+        };
+        let _ = writeln!(out, "{}_sum{} {}", name, labels, sum);
+        let _ = writeln!(out, "{}_count{} {}", name, labels, count);
+    }
+}
+
+#[derive(Default)]
+pub struct Counter(AtomicU64);
+
+impl Counter {
+    pub fn add(&self, n: u64) {
+        self.0.fetch_add(n, Ordering::Relaxed);
+    }
+
+    pub fn get(&self) -> u64 {
+        self.0.load(Ordering::Relaxed)
+    }
+}
+
+/// Write the header of a metric in the Prometheus text format
+pub fn render_header(out: &mut String, name: &str, kind: &str, help: &str) {
+    let _ = writeln!(out, "# HELP {} {}", name, help);
+    let _ = writeln!(out, "# TYPE {} {}", name, kind);
+}
+
+/// Write a counter in the Prometheus text format
+pub fn render_counter(out: &mut String, name: &str, help: &str, value: u64) {
+    render_header(out, name, "counter", help);
+    let _ = writeln!(out, "{} {}", name, value);
+}
+
+/// Latency of each stage of a search, and the work done by the index
+///
+/// Shards keep their own search histogram, see `Shard::search_time`
+#[derive(Default)]
+pub struct Metrics {
+    pub decode: Histogram,
+    pub extract: Histogram,
+    /// Indexed by the fields of `StageTimes`, in order
+    pub extract_stages: [Histogram; 5],
+    pub search: Histogram,
+    pub score: Histogram,
+    pub resolve: Histogram,
+    /// Inverted lists scanned, summed over shards and query descriptors
+    pub lists_scanned: Counter,
+    /// Neighbors returned by the shards, before scoring
+    pub candidates: Counter,
+    /// Adaptive searches moved to a more expensive stage
+    pub adaptive_widened: Counter,
+}
+
+pub static METRICS: Lazy<Metrics> = Lazy::new(Metrics::default);
+
+impl Metrics {
+    const STAGES: [&'static str; 5] =
+        ["pyramid", "keypoints", "orientation", "blur", "descriptors"];
+
+    pub fn observe_stages(&self, stages: &StageTimes) {
+        let times = [
+            stages.pyramid,
+            stages.keypoints,
+            stages.orientation,
+            stages.blur,
+            stages.descriptors,
+        ];
+        for (histogram, &seconds) in self.extract_stages.iter().zip(times.iter()) {
+            histogram.observe(seconds);
+        }
+    }
+
+    pub fn render(&self, out: &mut String) {
+        let histograms = [
+            ("imsearch_decode_seconds", "Image decoding", &self.decode),
+            ("imsearch_extract_seconds", "ORB extraction", &self.extract),
+            (
+                "imsearch_search_seconds",
+                "Index search over all shards",
+                &self.search,
+            ),
+            (
+                "imsearch_score_seconds",
+                "Scoring matched images",
+                &self.score,
+            ),
+            (
+                "imsearch_resolve_seconds",
+                "Reading the paths of results",
+                &self.resolve,
+            ),
+        ];
+        for (name, help, histogram) in histograms.iter() {
+            render_header(out, name, "histogram", help);
+            histogram.render(out, name, "");
+        }
+
+        let name = "imsearch_extract_stage_seconds";
+        render_header(out, name, "histogram", "Stages of ORB extraction");
+        for (stage, histogram) in Self::STAGES.iter().zip(self.extract_stages.iter()) {
+            histogram.render(out, name, &format!("stage=\"{}\"", stage));
+        }
+
+        render_counter(
+            out,
+            "imsearch_lists_scanned_total",
+            "Inverted lists scanned",
+            self.lists_scanned.get(),
+        );
+        render_counter(
+            out,
+            "imsearch_candidates_total",
+            "Neighbors returned by the index before scoring",
+            self.candidates.get(),
+        );
+        render_counter(
+            out,
+            "imsearch_adaptive_widened_total",
+            "Adaptive searches moved to a more expensive stage",
+            self.adaptive_widened.get(),
+        );
+    }
+}
@@ -0,0 +1,255 @@
+use std::io::{BufReader, BufWriter, Read, Write};
+use std::net::{TcpListener, TcpStream, ToSocketAddrs};
+use std::sync::Mutex;
+use std::time::Duration;
+
+use crate::matrix::{Matrix, MatrixView};
+use anyhow::{anyhow, bail, Result};
+use log::{debug, warn};
+
+/// Search results of a node, (score, image path) in descending score order
+pub type RemoteResult = Vec<(f32, String)>;
+
+/// Binary protocol between a coordinator and its search nodes, all integers are little endian
+///
+/// A request is `REQUEST_MAGIC, width: u32, rows: u32, limit: u32` followed by `rows * width`
+/// bytes of descriptors. A response is `RESPONSE_MAGIC, status: u32`, followed by
+/// `count: u32` and `count` of `(score: f32, path length: u32, path)` when the status is 0, or by
+/// `length: u32` and an error message otherwise. Connections are kept open for more requests.
+const REQUEST_MAGIC: &[u8; 4] = b"IMSQ";
+const RESPONSE_MAGIC: &[u8; 4] = b"IMSR";
+
+/// Larger requests are rejected, so a broken client can't make a node allocate without limit
+const MAX_REQUEST_BYTES: usize = 64 << 20;
+
+fn read_u32<R: Read>(reader: &mut R) -> std::io::Result<u32> {
+    let mut buf = [0u8; 4];
+    reader.read_exact(&mut buf)?;
+    Ok(u32::from_le_bytes(buf))
+}
+
+fn read_magic<R: Read>(reader: &mut R, magic: &[u8; 4]) -> Result<()> {
+    let mut buf = [0u8; 4];
+    reader.read_exact(&mut buf)?;
+    if &buf != magic {
+        bail!("unknown message {:?}", buf);
+    }
+    Ok(())
+}
+
+/// Answer descriptor searches on `listener` with `search`, one thread per connection
+///
+/// `search` receives the descriptors and the maximum number of results
+pub fn serve<F>(listener: TcpListener, search: F) -> !
+where
+    F: Fn(MatrixView, usize) -> Result<RemoteResult> + Send + Sync + 'static,
+{
+    let search = std::sync::Arc::new(search);
+    loop {
+        let stream = match listener.accept() {
+            Ok((stream, addr)) => {
+                debug!("search node connected by {}", addr);
+                stream
+            }
+            Err(e) => {
+                warn!("failed to accept connection: {}", e);
+                continue;
+            }
+        };
+        let search = search.clone();
+        std::thread::spawn(move || {
+            if let Err(e) = handle_connection(stream, &*search) {
+                debug!("search node connection closed: {}", e);
+            }
+        });
+    }
+}
+
+fn handle_connection<F>(stream: TcpStream, search: &F) -> Result<()>
+where
+    F: Fn(MatrixView, usize) -> Result<RemoteResult>,
+{
+    stream.set_nodelay(true)?;
+    let mut reader = BufReader::new(stream.try_clone()?);
+    let mut writer = BufWriter::new(stream);
+    let mut descriptors = vec![];
+    loop {
+        read_magic(&mut reader, REQUEST_MAGIC)?;
+        let width = read_u32(&mut reader)? as usize;
+        let rows = read_u32(&mut reader)? as usize;
+        let limit = read_u32(&mut reader)? as usize;
+        if width == 0 || width * rows > MAX_REQUEST_BYTES {
+            bail!("bad request of {} x {} bytes", rows, width);
+        }
+        descriptors.resize(width * rows, 0);
+        reader.read_exact(&mut descriptors)?;
+
+        writer.write_all(RESPONSE_MAGIC)?;
+        match search(MatrixView::new(width, &descriptors), limit) {
+            Ok(result) => {
+                writer.write_all(&0u32.to_le_bytes())?;
+                writer.write_all(&(result.len() as u32).to_le_bytes())?;
+                for (score, path) in result.iter() {
+                    writer.write_all(&score.to_le_bytes())?;
+                    writer.write_all(&(path.len() as u32).to_le_bytes())?;
+                    writer.write_all(path.as_bytes())?;
+                }
+            }
+            Err(e) => {
+                let message = e.to_string();
+                writer.write_all(&1u32.to_le_bytes())?;
+                writer.write_all(&(message.len() as u32).to_le_bytes())?;
+                writer.write_all(message.as_bytes())?;
+            }
+        }
+        writer.flush()?;
+    }
+}
+
+/// A search node reached over the binary protocol, connections are reused between requests
+pub struct RemoteShard {
+    addr: String,
+    timeout: Duration,
+    connections: Mutex<Vec<TcpStream>>,
+}
+
+impl RemoteShard {
+    pub fn new(addr: String, timeout: Duration) -> Self {
+        Self {
+            addr,
+            timeout,
+            connections: Mutex::new(vec![]),
+        }
+    }
+
+    pub fn addr(&self) -> &str {
+        &self.addr
+    }
+
+    fn connect(&self) -> Result<TcpStream> {
+        let addr = self
+            .addr
+            .to_socket_addrs()?
+            .next()
+            .ok_or_else(|| anyhow!("failed to resolve {}", self.addr))?;
+        let stream = TcpStream::connect_timeout(&addr, self.timeout)?;
+        stream.set_nodelay(true)?;
+        stream.set_read_timeout(Some(self.timeout))?;
+        stream.set_write_timeout(Some(self.timeout))?;
+        Ok(stream)
+    }
+
+    /// Search the descriptors on the node, and return at most `limit` results
+    pub fn search<M: Matrix>(&self, descriptors: &M, limit: usize) -> Result<RemoteResult> {
+        let fresh = || -> Result<_> {
+            let stream = self.connect()?;
+            let result = Self::request(&stream, descriptors, limit)?;
+            Ok((stream, result))
+        };
+        let pooled = self.connections.lock().unwrap().pop();
+        // a failed connection is dropped instead of being put back
+        let (stream, result) = match pooled {
+            Some(stream) => match Self::request(&stream, descriptors, limit) {
+                Ok(result) => (stream, result),
+                // the node may have closed an idle connection, or restarted, errors reported by
+                // the node itself are not retried
+                Err(e) if e.downcast_ref::<std::io::Error>().is_some() => {
+                    debug!("pooled connection to {} failed: {}", self.addr, e);
+                    fresh()?
+                }
+                Err(e) => return Err(e),
+            },
+            None => fresh()?,
+        };
+        self.connections.lock().unwrap().push(stream);
+        Ok(result)
+    }
+
+    fn request<M: Matrix>(
+        stream: &TcpStream,
+        descriptors: &M,
+        limit: usize,
+    ) -> Result<RemoteResult> {
+        let mut writer = BufWriter::new(stream);
+        writer.write_all(REQUEST_MAGIC)?;
+        writer.write_all(&(descriptors.width() as u32).to_le_bytes())?;
+        writer.write_all(&(descriptors.height() as u32).to_le_bytes())?;
+        writer.write_all(&(limit as u32).to_le_bytes())?;
+        for line in (0..descriptors.height()).map(|i| descriptors.line(i)) {
+            writer.write_all(line)?;
+        }
+        writer.flush()?;
+        drop(writer);
+
+        let mut reader = BufReader::new(stream);
+        read_magic(&mut reader, RESPONSE_MAGIC)?;
+        let status = read_u32(&mut reader)?;
+        let count = read_u32(&mut reader)? as usize;
+        if status != 0 {
+            let mut message = vec![0u8; count];
+            reader.read_exact(&mut message)?;
+            bail!("{}", String::from_utf8_lossy(&message));
+        }
+        let mut result = Vec::with_capacity(count);
+        for _ in 0..count {
+            let mut score = [0u8; 4];
+            reader.read_exact(&mut score)?;
+            let mut path = vec![0u8; read_u32(&mut reader)? as usize];
+            reader.read_exact(&mut path)?;
+            result.push((f32::from_le_bytes(score), String::from_utf8(path)?));
+        }
+        // the response is small, and nothing is sent before the next request
+        if !reader.buffer().is_empty() {
+            bail!("unexpected data after response");
+        }
+        Ok(result)
+    }
+}
+
+/// Search all nodes at the same time, and merge their results by score
+///
+/// Nodes which fail are logged and skipped, an error is only returned if all of them fail
+pub fn search_all<M: Matrix + Sync>(
+    shards: &[RemoteShard],
+    descriptors: &M,
+    limit: usize,
+) -> Result<RemoteResult> {
+    let results = crossbeam_utils::thread::scope(|s| {
+        let handles = shards
+            .iter()
+            .map(|shard| s.spawn(move |_| shard.search(descriptors, limit)))
+            .collect::<Vec<_>>();
+        handles
+            .into_iter()
+            .map(|handle| handle.join().expect("remote search panicked"))
+            .collect::<Vec<_>>()
+    })
+    .expect("remote search panicked");
+
+    let mut merged = vec![];
+    let mut succeeded = 0;
+    let mut last_error = None;
+    for (shard, result) in shards.iter().zip(results) {
+        match result {
+            Ok(result) => {
+                merged.extend(result);
+                succeeded += 1;
+            }
+            Err(e) => {
+                warn!("search node {} failed: {}", shard.addr(), e);
+                last_error = Some(e);
+            }
+        }
+    }
+    if let Some(e) = last_error.filter(|_| succeeded == 0) {
+        return Err(e);
+    }
+    merge_results(&mut merged, limit);
+    Ok(merged)
+}
+
+/// Sort results by descending score and keep the first `limit`
+pub fn merge_results(results: &mut RemoteResult, limit: usize) {
+    results.sort_by(|a, b| b.0.partial_cmp(&a.0).unwrap_or(std::cmp::Ordering::Equal));
+    results.truncate(limit);
+}
@@ -32,6 +32,23 @@ pub struct Slam3ORB {
     raw: *const c_void,
 }
 
+/// Seconds spent in each stage of the extraction, see `Slam3ORB::set_time_stages`
+#[derive(Debug, Default, Copy, Clone)]
+pub struct StageTimes {
+    pub pyramid: f64,
+    /// FAST detection and octree distribution
+    pub keypoints: f64,
+    pub orientation: f64,
+    pub blur: f64,
+    pub descriptors: f64,
+}
+
+impl StageTimes {
+    pub fn total(&self) -> f64 {
+        self.pyramid + self.keypoints + self.orientation + self.blur + self.descriptors
+    }
+}
+
 impl Slam3ORB {
     pub fn create(
         nfeatures: i32,
@@ -61,6 +78,56 @@ impl Slam3ORB {
         Self::create(500, 1.2, 8, 20, 7, InterpolationFlags::Area, true)
     }
 
+    /// Keep pyramid and scratch buffers between calls instead of reallocating them per image
+    pub fn set_reuse_buffers(&mut self, reuse: bool) {
+        unsafe {
+            slam3_ORB_set_reuse_buffers(self.raw, reuse);
+        }
+    }
+
+    /// Use several threads to extract the features of a single image
+    pub fn set_parallel(&mut self, parallel: bool) {
+        unsafe {
+            slam3_ORB_set_parallel(self.raw, parallel);
+        }
+    }
+
+    /// Only blur the parts of each pyramid level that are sampled by a descriptor
+    pub fn set_blur_tiles(&mut self, blur_tiles: bool) {
+        unsafe {
+            slam3_ORB_set_blur_tiles(self.raw, blur_tiles);
+        }
+    }
+
+    /// Use the SIMD kernels if the CPU has them, the default. The features are the same either way
+    pub fn set_simd(&mut self, simd: bool) {
+        unsafe {
+            slam3_ORB_set_simd(self.raw, simd);
+        }
+    }
+
+    /// Time every stage of `detect_and_compute`, stages of a parallel extraction overlap
+    pub fn set_time_stages(&mut self, time_stages: bool) {
+        unsafe {
+            slam3_ORB_set_time_stages(self.raw, time_stages);
+        }
+    }
+
+    /// Return the time spent in each stage since the last call
+    pub fn take_stage_times(&mut self) -> StageTimes {
+        let mut times = [0f64; 5];
+        unsafe {
+            slam3_ORB_take_stage_times(self.raw, times.as_mut_ptr());
+        }
+        StageTimes {
+            pyramid: times[0],
+            keypoints: times[1],
+            orientation: times[2],
+            blur: times[3],
+            descriptors: times[4],
+        }
+    }
+
     pub fn detect_and_compute(
         &mut self,
         image: &dyn core::ToInputArray,
@@ -85,6 +152,28 @@ impl Slam3ORB {
         }
         Ok(())
     }
+
+    /// Compute descriptors of many images at once, the work is split across cores inside ORBextractor
+    ///
+    /// Descriptors of image `i` are rows `offsets[i]..offsets[i + 1]` of `descriptors`
+    pub fn detect_and_compute_batch(
+        &mut self,
+        images: &core::Vector<Mat>,
+        descriptors: &mut dyn core::ToOutputArray,
+        offsets: &mut core::Vector<i32>,
+    ) -> Result<()> {
+        let descriptors = descriptors.output_array()?;
+        unsafe {
+            slam3_ORB_detect_and_compute_batch(
+                self.raw,
+                images.as_raw_VectorOfMat(),
+                descriptors.as_raw__OutputArray(),
+                offsets.as_raw_mut_VectorOfi32(),
+            )
+            .into_result()?
+        }
+        Ok(())
+    }
 }
 
 impl Drop for Slam3ORB {
@@ -109,6 +198,12 @@ extern "C" {
         angle: bool,
     ) -> sys::Result<*const c_void>;
     fn slam3_ORB_delete(orb: *const c_void);
+    fn slam3_ORB_set_reuse_buffers(orb: *const c_void, reuse: bool);
+    fn slam3_ORB_set_parallel(orb: *const c_void, parallel: bool);
+    fn slam3_ORB_set_blur_tiles(orb: *const c_void, blur_tiles: bool);
+    fn slam3_ORB_set_simd(orb: *const c_void, simd: bool);
+    fn slam3_ORB_set_time_stages(orb: *const c_void, time_stages: bool);
+    fn slam3_ORB_take_stage_times(orb: *const c_void, times: *mut f64);
     fn slam3_ORB_detect_and_compute(
         orb: *const c_void,
         image: *const c_void,
@@ -117,14 +212,147 @@ extern "C" {
         descriptors: *const c_void,
         v_lapping_area: *const c_void,
     ) -> sys::Result_void;
+    fn slam3_ORB_detect_and_compute_batch(
+        orb: *const c_void,
+        images: *const c_void,
+        descriptors: *const c_void,
+        offsets: *const c_void,
+    ) -> sys::Result_void;
 }
 
 #[cfg(test)]
 mod test {
     use super::Slam3ORB;
-    use opencv::features2d;
-    use opencv::imgcodecs;
     use opencv::prelude::*;
+    use opencv::types::{VectorOfMat, VectorOfi32};
+    use opencv::{features2d, imgcodecs, imgproc};
+
+    /// box_in_scene.png in several sizes, and a view into it
+    fn test_images() -> VectorOfMat {
+        let img =
+            imgcodecs::imread("./cache/box_in_scene.png", imgcodecs::IMREAD_GRAYSCALE).unwrap();
+        let resized = |scale: f64| {
+            let mut resized = Mat::default();
+            let size = opencv::core::Size::default();
+            imgproc::resize(&img, &mut resized, size, scale, scale, imgproc::INTER_AREA).unwrap();
+            resized
+        };
+        let (larger, smaller) = (resized(1.5), resized(0.5));
+        let rect = opencv::core::Rect::new(7, 5, img.cols() - 20, img.rows() - 16);
+        let view = Mat::roi(&img, rect).unwrap();
+        VectorOfMat::from(vec![img, smaller, larger, view])
+    }
+
+    /// Keypoints (position, angle, octave) and descriptors of an image
+    fn extract(orb: &mut Slam3ORB, img: &Mat) -> (Vec<(f32, f32, f32, i32)>, Vec<u8>) {
+        let mask = Mat::default();
+        let lap = opencv::types::VectorOfi32::from(vec![0, 0]);
+        let mut kps = opencv::types::VectorOfKeyPoint::new();
+        let mut des = Mat::default();
+        orb.detect_and_compute(img, &mask, &mut kps, &mut des, &lap)
+            .unwrap();
+        let kps = kps
+            .iter()
+            .map(|kp| (kp.pt.x, kp.pt.y, kp.angle, kp.octave))
+            .collect();
+        (kps, des.data_typed::<u8>().unwrap().to_vec())
+    }
+
+    #[test]
+    fn simd_matches_scalar() {
+        let img =
+            imgcodecs::imread("./cache/box_in_scene.png", imgcodecs::IMREAD_GRAYSCALE).unwrap();
+        let mut orb = Slam3ORB::default().unwrap();
+        let simd = extract(&mut orb, &img);
+        orb.set_simd(false);
+        let scalar = extract(&mut orb, &img);
+        assert!(!scalar.0.is_empty());
+        assert_eq!(simd.0, scalar.0);
+        assert_eq!(simd.1, scalar.1);
+    }
+
+    /// Descriptors of every image of a batch
+    fn extract_batch(orb: &mut Slam3ORB, images: &VectorOfMat) -> Vec<Vec<u8>> {
+        let mut des = Mat::default();
+        let mut offsets = VectorOfi32::new();
+        orb.detect_and_compute_batch(images, &mut des, &mut offsets)
+            .unwrap();
+        let data = des.data_typed::<u8>().unwrap();
+        offsets
+            .to_vec()
+            .windows(2)
+            .map(|range| data[range[0] as usize * 32..range[1] as usize * 32].to_vec())
+            .collect()
+    }
+
+    #[test]
+    fn reused_buffers_match_fresh_extraction() {
+        let mut reused = Slam3ORB::default().unwrap();
+        reused.set_reuse_buffers(true);
+        // twice, so that the buffers held images of other sizes before each one
+        let images = test_images();
+        for img in images.iter().chain(images.iter()) {
+            let expected = extract(&mut Slam3ORB::default().unwrap(), &img);
+            assert!(!expected.0.is_empty());
+            assert_eq!(extract(&mut reused, &img), expected);
+        }
+    }
+
+    #[test]
+    fn parallel_matches_serial() {
+        let mut serial = Slam3ORB::default().unwrap();
+        let mut parallel = Slam3ORB::default().unwrap();
+        parallel.set_parallel(true);
+        for img in test_images().iter() {
+            let expected = extract(&mut serial, &img);
+            assert!(!expected.0.is_empty());
+            assert_eq!(extract(&mut parallel, &img), expected);
+        }
+    }
+
+    #[test]
+    fn batch_matches_single_images() {
+        let images = test_images();
+        let mut single = Slam3ORB::default().unwrap();
+        let expected = images
+            .iter()
+            .map(|img| extract(&mut single, &img).1)
+            .collect::<Vec<_>>();
+        assert!(expected.iter().all(|des| !des.is_empty()));
+
+        // settings given before the workers exist, then changed once they do
+        let mut orb = Slam3ORB::default().unwrap();
+        orb.set_parallel(true);
+        orb.set_reuse_buffers(true);
+        orb.set_time_stages(true);
+        assert_eq!(extract_batch(&mut orb, &images), expected);
+        assert!(orb.take_stage_times().total() > 0.);
+
+        orb.set_blur_tiles(true);
+        orb.set_simd(false);
+        orb.set_time_stages(false);
+        assert_eq!(extract_batch(&mut orb, &images), expected);
+        assert_eq!(orb.take_stage_times().total(), 0.);
+    }
+
+    #[test]
+    fn blur_tiles_match_full_blur() {
+        let img =
+            imgcodecs::imread("./cache/box_in_scene.png", imgcodecs::IMREAD_GRAYSCALE).unwrap();
+        // a view into a larger image too, whose neighbours must not leak into the border read by the
+        // tiles. Only tile mode isolates the level 0 border, the whole level blur never reads it
+        let rect = opencv::core::Rect::new(7, 5, img.cols() - 20, img.rows() - 16);
+        let view = Mat::roi(&img, rect).unwrap();
+        for img in [&img, &view].iter() {
+            let mut orb = Slam3ORB::default().unwrap();
+            let full = extract(&mut orb, img);
+            orb.set_blur_tiles(true);
+            let tiles = extract(&mut orb, img);
+            assert!(!full.0.is_empty());
+            assert_eq!(full.0, tiles.0);
+            assert_eq!(full.1, tiles.1);
+        }
+    }
 
     #[test]
     fn detect_and_compute() {
@@ -1,8 +1,11 @@
+use std::cmp::{Ordering, Reverse};
+use std::collections::BinaryHeap;
 use std::fs::File;
-use std::io::{Read, Write};
+use std::io::{BufWriter, Read, Seek, SeekFrom, Write};
 use std::path::Path;
 use std::time::{Duration, Instant};
 
+use crate::matrix::{Matrix, Matrix2D};
 use crate::slam3_orb::Slam3ORB;
 use anyhow::Result;
 use blake3::Hash;
@@ -26,14 +29,117 @@ pub fn detect_and_compute(
     Ok((kps, des))
 }
 
+/// Copy the descriptors in descending FAST response of their keypoints, strongest first
+pub fn sort_by_response(keypoints: &types::VectorOfKeyPoint, descriptors: &Mat) -> Matrix2D {
+    let mut order = (0..descriptors.height()).collect::<Vec<_>>();
+    let responses = keypoints.iter().map(|kp| kp.response).collect::<Vec<_>>();
+    order.sort_by(|&a, &b| {
+        let (a, b) = (responses.get(a), responses.get(b));
+        b.partial_cmp(&a).unwrap_or(Ordering::Equal)
+    });
+    let mut sorted = Matrix2D::with_capacity(descriptors.width(), descriptors.height());
+    for i in order {
+        sorted.push(descriptors.line(i));
+    }
+    sorted
+}
+
+/// Compute descriptors of a batch of images
+///
+/// Return all descriptors in one matrix, together with the row offset of each image
+pub fn detect_and_compute_batch(
+    orb: &mut Slam3ORB,
+    images: &types::VectorOfMat,
+) -> Result<(Mat, Vec<usize>)> {
+    let mut des = Mat::default();
+    let mut offsets = types::VectorOfi32::new();
+    orb.detect_and_compute_batch(images, &mut des, &mut offsets)?;
+    Ok((des, offsets.iter().map(|n| n as usize).collect()))
+}
+
 pub fn imread<S: AsRef<str>>(filename: S) -> Result<Mat> {
-    let mut img = imgcodecs::imread(filename.as_ref(), imgcodecs::IMREAD_GRAYSCALE)?;
+    let data = std::fs::read(filename.as_ref())?;
+    imdecode(&data)
+}
+
+/// Decode an image file to grayscale, and shrink it to fit in 1920x1080
+///
+/// Large JPEG files are decoded at 1/2, 1/4 or 1/8 of their size with DCT scaling, as long as
+/// the result is still larger than 1920x1080, so the full resolution is never decoded
+pub fn imdecode(data: &[u8]) -> Result<Mat> {
+    let flags = match image_size(data) {
+        Some((ImageFormat::Jpeg, width, height)) => {
+            match reduce_factor(width, height, 1920, 1080) {
+                8 => imgcodecs::IMREAD_REDUCED_GRAYSCALE_8,
+                4 => imgcodecs::IMREAD_REDUCED_GRAYSCALE_4,
+                2 => imgcodecs::IMREAD_REDUCED_GRAYSCALE_2,
+                _ => imgcodecs::IMREAD_GRAYSCALE,
+            }
+        }
+        _ => imgcodecs::IMREAD_GRAYSCALE,
+    };
+    let mat = Mat::from_slice(data)?;
+    let mut img = imgcodecs::imdecode(&mat, flags)?;
+    if img.empty() {
+        anyhow::bail!("failed to decode image");
+    }
     if img.cols() > 1920 || img.rows() > 1080 {
         img = adjust_image_size(&img, 1920, 1080)?;
     }
     Ok(img)
 }
 
+#[derive(Debug, Copy, Clone, PartialEq)]
+enum ImageFormat {
+    Jpeg,
+    Png,
+}
+
+/// Read the size of a JPEG or PNG image from its header, without decoding it
+fn image_size(data: &[u8]) -> Option<(ImageFormat, u32, u32)> {
+    let be16 = |i: usize| Some(u16::from_be_bytes([*data.get(i)?, *data.get(i + 1)?]) as u32);
+    if data.starts_with(b"\x89PNG\r\n\x1a\n") {
+        let be32 = |i: usize| {
+            let bytes = data.get(i..i + 4)?;
+            Some(u32::from_be_bytes([bytes[0], bytes[1], bytes[2], bytes[3]]))
+        };
+        return Some((ImageFormat::Png, be32(16)?, be32(20)?));
+    }
+    if !data.starts_with(&[0xff, 0xd8]) {
+        return None;
+    }
+    // walk the segments until a start of frame, which holds the size
+    let mut i = 2;
+    while i + 4 <= data.len() {
+        if data[i] != 0xff {
+            return None;
+        }
+        let marker = data[i + 1];
+        match marker {
+            // padding
+            0xff => i += 1,
+            // segments without a length
+            0x01 | 0xd0..=0xd7 => i += 2,
+            0xc0..=0xcf if !matches!(marker, 0xc4 | 0xc8 | 0xcc) => {
+                return Some((ImageFormat::Jpeg, be16(i + 7)?, be16(i + 5)?));
+            }
+            _ => i += 2 + be16(i + 2)? as usize,
+        }
+    }
+    None
+}
+
+/// Largest DCT scaling factor which keeps both sides of the image larger than the maximum size
+///
+/// `adjust_image_size` then still shrinks the reduced image to the same size as the full one
+fn reduce_factor(width: u32, height: u32, max_width: u32, max_height: u32) -> u32 {
+    [8, 4, 2]
+        .iter()
+        .copied()
+        .find(|&factor| width / factor > max_width && height / factor > max_height)
+        .unwrap_or(1)
+}
+
 pub fn imshow(winname: &str, mat: &dyn core::ToInputArray) -> Result<()> {
     highgui::imshow(winname, mat)?;
     while highgui::get_window_property(
@@ -141,6 +247,9 @@ pub fn read_line(prompt: &str) -> Result<String> {
     Ok(String::from_utf8(v)?.trim().to_owned())
 }
 
+// 98% 置信度
+const WILSON_Z: f32 = 2.326;
+
 /// 威尔逊得分
 /// 基于：https://www.jianshu.com/p/4d2b45918958
 pub fn wilson_score(scores: &[f32]) -> f32 {
@@ -150,16 +259,348 @@ pub fn wilson_score(scores: &[f32]) -> f32 {
     }
     let mean = scores.iter().sum::<f32>() / count;
     let var = scores.iter().map(|&a| (mean - a).powi(2)).sum::<f32>() / count;
-    // 98% 置信度
-    let z = 2.326f32;
+    wilson(count, mean, var)
+}
 
+fn wilson(count: f32, mean: f32, var: f32) -> f32 {
+    let z = WILSON_Z;
     (mean + z.powi(2) / (2. * count) - ((z / (2. * count)) * (4. * count * var + z.powi(2)).sqrt()))
         / (1. + z.powi(2) / count)
 }
 
+/// Upper bound of the wilson score of `count` scores which are all <= 1
+///
+/// With mean <= 1 and var >= 0, the score is at most mean / (1 + z^2 / count), which grows with count
+fn wilson_upper_bound(count: u32) -> f32 {
+    1. / (1. + WILSON_Z.powi(2) / count as f32)
+}
+
+/// Running sums of the scores of one candidate, enough to compute its wilson score
+#[derive(Debug, Default, Copy, Clone)]
+pub struct ScoreAccumulator {
+    count: u32,
+    sum: f32,
+    sum_sq: f32,
+}
+
+impl ScoreAccumulator {
+    /// Add a score in [0, 1]
+    pub fn add(&mut self, score: f32) {
+        self.count += 1;
+        self.sum += score;
+        self.sum_sq += score * score;
+    }
+
+    pub fn count(&self) -> u32 {
+        self.count
+    }
+
+    pub fn wilson_score(&self) -> f32 {
+        if self.count == 0 {
+            return 0.;
+        }
+        let count = self.count as f32;
+        let mean = self.sum / count;
+        let var = (self.sum_sq / count - mean * mean).max(0.);
+        wilson(count, mean, var)
+    }
+}
+
+/// Reversed order by score, so that a BinaryHeap pops the lowest score
+struct MinScore<K>(f32, K);
+
+impl<K> PartialEq for MinScore<K> {
+    fn eq(&self, other: &Self) -> bool {
+        self.0 == other.0
+    }
+}
+
+impl<K> Eq for MinScore<K> {}
+
+impl<K> PartialOrd for MinScore<K> {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl<K> Ord for MinScore<K> {
+    fn cmp(&self, other: &Self) -> Ordering {
+        other.0.partial_cmp(&self.0).unwrap_or(Ordering::Equal)
+    }
+}
+
+/// Select the `limit` candidates with the best wilson score, best first
+///
+/// Candidates are visited by decreasing count, and the scan stops as soon as the upper bound of
+/// the remaining candidates cannot beat the current top `limit`
+pub fn top_wilson_scores<K, I>(candidates: I, limit: usize) -> Vec<(f32, K)>
+where
+    I: IntoIterator<Item = (K, ScoreAccumulator)>,
+{
+    if limit == 0 {
+        return vec![];
+    }
+    let mut candidates = candidates.into_iter().collect::<Vec<_>>();
+    candidates.sort_unstable_by_key(|(_, acc)| Reverse(acc.count));
+
+    let mut heap = BinaryHeap::with_capacity(limit + 1);
+    for (key, acc) in candidates {
+        if heap.len() == limit {
+            let MinScore(min, _) = heap.peek().unwrap();
+            if wilson_upper_bound(acc.count) <= *min {
+                break;
+            }
+        }
+        heap.push(MinScore(acc.wilson_score(), key));
+        if heap.len() > limit {
+            heap.pop();
+        }
+    }
+
+    let mut results = heap
+        .into_iter()
+        .map(|MinScore(score, key)| (score, key))
+        .collect::<Vec<_>>();
+    results.sort_unstable_by(|a, b| b.0.partial_cmp(&a.0).unwrap());
+    results
+}
+
+/// Hash the content of an image, which identifies it in the database
+pub fn hash_data(data: &[u8]) -> Hash {
+    blake3::hash(data)
+}
+
 pub fn hash_file<P: AsRef<Path>>(path: P) -> Result<Hash> {
     let mut file = File::open(path)?;
     let mut data = vec![];
     file.read_to_end(&mut data)?;
     Ok(blake3::hash(&data))
 }
+
+/// SplitMix64, a small and fast generator which is good enough for sampling
+pub struct SplitMix64(u64);
+
+impl SplitMix64 {
+    pub fn new(seed: u64) -> Self {
+        Self(seed)
+    }
+
+    pub fn next_u64(&mut self) -> u64 {
+        self.0 = self.0.wrapping_add(0x9e3779b97f4a7c15);
+        let mut z = self.0;
+        z = (z ^ (z >> 30)).wrapping_mul(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)).wrapping_mul(0x94d049bb133111eb);
+        z ^ (z >> 31)
+    }
+}
+
+/// Take a uniform sample of at most `capacity` lines with reservoir sampling
+///
+/// Memory is bounded by the sample, however long the input is
+pub fn reservoir_sample<I, T>(lines: I, width: usize, capacity: usize, seed: u64) -> Matrix2D
+where
+    I: IntoIterator<Item = T>,
+    T: AsRef<[u8]>,
+{
+    let mut rng = SplitMix64::new(seed);
+    let mut sample = Matrix2D::with_capacity(width, capacity);
+    for (seen, line) in lines.into_iter().enumerate() {
+        if seen < capacity {
+            sample.push(line.as_ref());
+            continue;
+        }
+        let j = (rng.next_u64() % (seen as u64 + 1)) as usize;
+        if j < capacity {
+            sample.line_mut(j).copy_from_slice(line.as_ref());
+        }
+    }
+    sample
+}
+
+/// Write a 2d u8 array to a .npy file one row at a time
+///
+/// The header is written first with room for any row count, and rewritten with the real count
+/// by `finish`
+pub struct NpyWriter {
+    file: BufWriter<File>,
+    width: usize,
+    rows: u64,
+}
+
+impl NpyWriter {
+    /// Size of the header, large enough for a 20 digit row count
+    const HEADER_LEN: usize = 128;
+
+    pub fn create<P: AsRef<Path>>(path: P, width: usize) -> Result<Self> {
+        let mut file = BufWriter::with_capacity(8 << 20, File::create(path)?);
+        file.write_all(&Self::header(0, width))?;
+        Ok(Self {
+            file,
+            width,
+            rows: 0,
+        })
+    }
+
+    fn header(rows: u64, width: usize) -> Vec<u8> {
+        let dict = format!(
+            "{{'descr': '|u1', 'fortran_order': False, 'shape': ({}, {}), }}",
+            rows, width
+        );
+        // magic, version 1.0, header length, then the dict padded with spaces and ended by \n
+        let mut header = b"\x93NUMPY\x01\x00".to_vec();
+        header.extend_from_slice(&((Self::HEADER_LEN - 10) as u16).to_le_bytes());
+        header.extend_from_slice(dict.as_bytes());
+        header.resize(Self::HEADER_LEN - 1, b' ');
+        header.push(b'\n');
+        header
+    }
+
+    pub fn push(&mut self, row: &[u8]) -> Result<()> {
+        assert_eq!(row.len(), self.width);
+        self.file.write_all(row)?;
+        self.rows += 1;
+        Ok(())
+    }
+
+    /// Flush all rows and write the final header, return the number of rows
+    pub fn finish(self) -> Result<u64> {
+        let mut file = self.file.into_inner().map_err(|e| e.into_error())?;
+        file.seek(SeekFrom::Start(0))?;
+        file.write_all(&Self::header(self.rows, self.width))?;
+        file.sync_all()?;
+        Ok(self.rows)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{
+        image_size, reduce_factor, reservoir_sample, top_wilson_scores, wilson_upper_bound,
+        ImageFormat, NpyWriter, ScoreAccumulator, SplitMix64,
+    };
+    use crate::matrix::Matrix;
+
+    fn random_candidates(n: usize, seed: u64) -> Vec<(usize, ScoreAccumulator)> {
+        let mut rng = SplitMix64::new(seed);
+        (0..n)
+            .map(|key| {
+                let mut acc = ScoreAccumulator::default();
+                for _ in 0..rng.next_u64() % 50 + 1 {
+                    acc.add((rng.next_u64() % 1001) as f32 / 1000.);
+                }
+                (key, acc)
+            })
+            .collect()
+    }
+
+    #[test]
+    fn top_wilson_scores_match_full_sort() {
+        let candidates = random_candidates(1000, 1);
+        for (_, acc) in &candidates {
+            assert!(acc.wilson_score() <= wilson_upper_bound(acc.count()));
+        }
+
+        let mut all = candidates
+            .iter()
+            .map(|(key, acc)| (acc.wilson_score(), *key))
+            .collect::<Vec<_>>();
+        all.sort_by(|a, b| b.0.partial_cmp(&a.0).unwrap());
+        for &limit in &[1, 10, 100, 1000, 2000] {
+            let top = top_wilson_scores(candidates.iter().copied(), limit);
+            let scores = top.iter().map(|(score, _)| *score).collect::<Vec<_>>();
+            let expected = all.iter().take(limit).map(|(score, _)| *score);
+            assert_eq!(scores, expected.collect::<Vec<_>>());
+            // the keys agree with their scores, whatever the order of ties
+            for (score, key) in top {
+                assert_eq!(candidates[key].1.wilson_score(), score);
+            }
+        }
+        assert!(top_wilson_scores(candidates, 0).is_empty());
+    }
+
+    #[test]
+    fn npy_writer() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("train.npy");
+        let mut writer = NpyWriter::create(&path, 4).unwrap();
+        for row in 0..3u8 {
+            writer.push(&[row; 4]).unwrap();
+        }
+        assert_eq!(writer.finish().unwrap(), 3);
+
+        let data = std::fs::read(&path).unwrap();
+        let header = &data[..NpyWriter::HEADER_LEN];
+        assert!(header.starts_with(b"\x93NUMPY\x01\x00"));
+        let len = u16::from_le_bytes([header[8], header[9]]) as usize;
+        assert_eq!(10 + len, NpyWriter::HEADER_LEN);
+        let dict = std::str::from_utf8(&header[10..]).unwrap();
+        assert!(dict.contains("'shape': (3, 4)"));
+        assert!(dict.ends_with('\n'));
+        assert_eq!(
+            &data[NpyWriter::HEADER_LEN..],
+            &[0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2]
+        );
+
+        // the rewritten header must not change size, whatever the row count
+        assert_eq!(NpyWriter::header(u64::MAX, 32).len(), NpyWriter::HEADER_LEN);
+    }
+
+    #[test]
+    fn reservoir_sample_is_uniform() {
+        let lines = (0..1000u64).map(|n| n.to_le_bytes()).collect::<Vec<_>>();
+        let index = |line: &[u8]| {
+            let mut bytes = [0; 8];
+            bytes.copy_from_slice(line);
+            u64::from_le_bytes(bytes)
+        };
+
+        // everything fits, in order
+        let sample = reservoir_sample(lines.iter(), 8, 2000, 0);
+        assert_eq!(sample.height(), 1000);
+        assert!(sample.iter_lines().map(index).eq(0..1000));
+
+        let mut first_half = 0;
+        for seed in 0..200 {
+            let sample = reservoir_sample(lines.iter(), 8, 100, seed);
+            assert_eq!(sample.height(), 100);
+            let mut picked = sample.iter_lines().map(index).collect::<Vec<_>>();
+            picked.sort_unstable();
+            picked.dedup();
+            assert_eq!(picked.len(), 100);
+            first_half += picked.iter().filter(|&&n| n < 500).count();
+        }
+        // 10000 expected out of 20000
+        assert!((9500..10500).contains(&first_half), "{}", first_half);
+
+        let a = reservoir_sample(lines.iter(), 8, 100, 7);
+        let b = reservoir_sample(lines.iter(), 8, 100, 7);
+        assert!(a.iter_lines().eq(b.iter_lines()));
+    }
+
+    #[test]
+    fn imdecode_reduce_factor() {
+        assert_eq!(reduce_factor(1920, 1080, 1920, 1080), 1);
+        // halving would make it exactly 1920x1080, which is not larger
+        assert_eq!(reduce_factor(3840, 2160, 1920, 1080), 1);
+        assert_eq!(reduce_factor(4000, 3000, 1920, 1080), 2);
+        assert_eq!(reduce_factor(8000, 4500, 1920, 1080), 4);
+        assert_eq!(reduce_factor(16000, 9000, 1920, 1080), 8);
+        assert_eq!(reduce_factor(32000, 18000, 1920, 1080), 8);
+        // both sides must stay larger
+        assert_eq!(reduce_factor(16000, 2000, 1920, 1080), 1);
+
+        // SOI, an APP0 segment, then a baseline start of frame of 4000x3000
+        let mut jpeg = vec![0xff, 0xd8, 0xff, 0xe0, 0x00, 0x04, 0x00, 0x00];
+        jpeg.extend_from_slice(&[0xff, 0xc0, 0x00, 0x11, 0x08, 0x0b, 0xb8, 0x0f, 0xa0, 0x01]);
+        assert_eq!(image_size(&jpeg), Some((ImageFormat::Jpeg, 4000, 3000)));
+        // a DHT segment is not a start of frame
+        jpeg[9] = 0xc4;
+        assert_eq!(image_size(&jpeg), None);
+
+        let mut png = b"\x89PNG\r\n\x1a\n\x00\x00\x00\x0dIHDR".to_vec();
+        png.extend_from_slice(&4000u32.to_be_bytes());
+        png.extend_from_slice(&3000u32.to_be_bytes());
+        assert_eq!(image_size(&png), Some((ImageFormat::Png, 4000, 3000)));
+        assert_eq!(image_size(b"GIF89a"), None);
+    }
+}
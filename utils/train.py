@@ -6,13 +6,17 @@ import numpy as np
 
 
 def main():
-    if len(argv) != 3:
-        print(f"Usage: {argv[0]} K train.npy")
+    if len(argv) not in (3, 4):
+        print(f"Usage: {argv[0]} K train.npy [HNSW_M]")
         return
 
     k = int(argv[1])
     d = 256
-    quantizer = faiss.IndexBinaryFlat(d)
+    # an HNSW quantizer avoids scanning all K centroids for every query, same as BIVF{K}_HNSW{M}
+    if len(argv) == 4:
+        quantizer = faiss.IndexBinaryHNSW(d, int(argv[3]))
+    else:
+        quantizer = faiss.IndexBinaryFlat(d)
     index = faiss.IndexBinaryIVF(quantizer, d, k)
     clustering_index = faiss.index_cpu_to_all_gpus(faiss.IndexFlatL2(d))
     index.clustering_index = clustering_index